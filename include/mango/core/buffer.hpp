@@ -5,6 +5,8 @@
 #pragma once
 
 #include <cstddef>
+#include <mutex>
+#include <vector>
 #include "configure.hpp"
 #include "memory.hpp"
 #include "stream.hpp"
@@ -12,35 +14,115 @@
 namespace mango
 {
 
+    /*
+        Buffer is a memory stream which grows geometrically when it is written past
+        the capacity. The storage can be moved in and out without copying with
+        adopt() and release().
+
+        Usage example:
+
+        Buffer buffer;
+        ImageEncoder(".jpg").encode(buffer, bitmap, 0.9f);
+
+        // hand the storage over; it is released with free_storage()
+        Allocation allocation = buffer.allocation();
+        Memory memory = buffer.release();
+        // TODO: do your stuff here..
+        free_storage(memory.address, allocation);
+
+    */
+
     class Buffer : public Stream
     {
     private:
         Memory m_memory;
         size_t m_capacity;
         size_t m_offset;
+        Allocation m_allocation;
 
     public:
         Buffer();
         Buffer(size_t bytes);
+        Buffer(size_t bytes, Allocation allocation);
         Buffer(const u8* address, size_t bytes);
         Buffer(Memory memory);
+        Buffer(Buffer&& buffer);
         ~Buffer();
 
+        Buffer& operator = (Buffer&& buffer);
+
         size_t capacity() const;
+        Allocation allocation() const;
         void reserve(size_t bytes);
         void resize(size_t bytes);
 
+        // empty the buffer but keep the capacity
+        void reset();
+
+        // give up the ownership of the storage; the buffer is left empty
+        Memory release();
+
+        // take the ownership of storage allocated with allocate_storage(capacity, allocation)
+        void adopt(Memory memory, size_t capacity, Allocation allocation = Allocation::DEFAULT);
+
         // memory
         u8* data() const;
         operator Memory () const;
 		operator u8* () const;
 
         // stream
+        using Stream::write;
+
         u64 size() const;
         u64 offset() const;
         void seek(u64 distance, SeekMode mode);
         void read(void* dest, size_t bytes);
         void write(const void* data, size_t bytes);
+        void write(const Memory* segments, size_t count);
+    };
+
+    /*
+        BufferCache recycles the storage of Buffers, so that producing a stream of
+        encoded images reuses the same memory instead of growing a new Buffer from
+        scratch each time. The cache is thread-safe.
+
+        Usage example:
+
+        BufferCache cache;
+
+        Buffer buffer = cache.acquire(64 * 1024);
+        encoder.encode(buffer, bitmap, 0.9f);
+        // TODO: send the buffer..
+        cache.recycle(buffer);
+
+    */
+
+    class BufferCache : private NonCopyable
+    {
+    protected:
+        struct Storage
+        {
+            u8* address;
+            size_t capacity;
+            Allocation allocation;
+        };
+
+        std::mutex m_mutex;
+        std::vector<Storage> m_storage;
+        size_t m_max_count;
+        size_t m_max_capacity;
+
+    public:
+        BufferCache(size_t maxCount = 16, size_t maxCapacity = 64 * 1024 * 1024);
+        ~BufferCache();
+
+        // empty buffer with at least the requested capacity
+        Buffer acquire(size_t capacity = 0, Allocation allocation = Allocation::DEFAULT);
+
+        // keep the storage of the buffer for reuse; the buffer is left empty
+        void recycle(Buffer& buffer);
+
+        void clear();
     };
 
 } // namespace mango
@@ -158,6 +158,30 @@ namespace mango
         void decompress(Memory dest, Memory source);
     }
 
+    // -----------------------------------------------------------------------
+    // inflate
+    // -----------------------------------------------------------------------
+
+    // Fast decoders for raw deflate (RFC 1951) and zlib (RFC 1950) streams. The
+    // whole stream is decoded from memory into memory. The functions return the
+    // number of decoded bytes and throw if the stream is corrupted or does not
+    // fit into the destination.
+
+    namespace deflate
+    {
+        size_t decompress(Memory dest, Memory source);
+    }
+
+    namespace zlib
+    {
+        size_t decompress(Memory dest, Memory source);
+
+        // lenient variant for image decoders: the data which does not fit into the
+        // destination is discarded and the checksum is reported instead of verified
+        // (false when it does not match, is missing or the stream was truncated)
+        size_t decompress(Memory dest, Memory source, bool& checksum);
+    }
+
     // -----------------------------------------------------------------------
     // Compressor
     // -----------------------------------------------------------------------
@@ -620,6 +620,15 @@
     // ETC1, ETC2, ASTC texture compression
 #endif
 
+// -----------------------------------------------------------------------
+// language features
+// -----------------------------------------------------------------------
+
+#if defined(__cpp_impl_coroutine) && (__cpp_impl_coroutine >= 201902L)
+    // C++20 coroutines
+    #define MANGO_ENABLE_COROUTINE
+#endif
+
 // -----------------------------------------------------------------------
 // integer types
 // -----------------------------------------------------------------------
@@ -20,8 +20,10 @@
 #include "object.hpp"
 #include "stream.hpp"
 #include "timer.hpp"
+#include "trace.hpp"
 #include "buffer.hpp"
 #include "memory.hpp"
 #include "string.hpp"
 #include "thread.hpp"
+#include "coroutine.hpp"
 #include "dynamic_library.hpp"
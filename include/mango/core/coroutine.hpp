@@ -0,0 +1,348 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2019 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#pragma once
+
+#include "configure.hpp"
+#include "thread.hpp"
+
+#ifdef MANGO_ENABLE_COROUTINE
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+#include <mutex>
+#include <condition_variable>
+
+namespace mango
+{
+
+    /*
+        AsyncTask<T> is the return type of a coroutine which produces T. The coroutine
+        starts when it is awaited and the awaiting coroutine is resumed on the thread
+        which completes the task, so a chain of coroutines does not block any threads
+        while the work is in the ThreadPool. syncWait() blocks the calling thread until
+        the task has completed; it is the bridge from regular code into coroutines.
+        Like FutureTask::get() it must not be called from a ThreadPool task, as the
+        blocked workers might be the ones needed to complete the coroutine.
+
+        Usage example:
+
+        AsyncTask<int> compute(ThreadPool& pool)
+        {
+            // continue in a worker thread
+            co_await pool.schedule();
+            co_return 7;
+        }
+
+        AsyncTask<int> sum(ThreadPool& pool)
+        {
+            int a = co_await compute(pool);
+            int b = co_await compute(pool);
+            co_return a + b;
+        }
+
+        int x = syncWait(sum(ThreadPool::getInstance()));
+
+    */
+
+    template <typename T>
+    class AsyncTask;
+
+    namespace detail
+    {
+
+        class AsyncPromiseBase
+        {
+        protected:
+            std::coroutine_handle<> m_continuation;
+            std::exception_ptr m_exception;
+
+            struct FinalAwaiter
+            {
+                bool await_ready() const noexcept
+                {
+                    return false;
+                }
+
+                template <typename Promise>
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+                {
+                    // resume the awaiting coroutine without growing the stack
+                    std::coroutine_handle<> continuation = handle.promise().m_continuation;
+                    return continuation ? continuation : std::noop_coroutine();
+                }
+
+                void await_resume() const noexcept
+                {
+                }
+            };
+
+        public:
+            std::suspend_always initial_suspend() const noexcept
+            {
+                return {};
+            }
+
+            FinalAwaiter final_suspend() const noexcept
+            {
+                return {};
+            }
+
+            void unhandled_exception() noexcept
+            {
+                m_exception = std::current_exception();
+            }
+
+            void setContinuation(std::coroutine_handle<> continuation) noexcept
+            {
+                m_continuation = continuation;
+            }
+
+            void rethrow() const
+            {
+                if (m_exception)
+                {
+                    std::rethrow_exception(m_exception);
+                }
+            }
+        };
+
+        template <typename T>
+        class AsyncPromise : public AsyncPromiseBase
+        {
+        protected:
+            std::optional<T> m_value;
+
+        public:
+            AsyncTask<T> get_return_object() noexcept;
+
+            template <typename V>
+            void return_value(V&& value)
+            {
+                m_value.emplace(std::forward<V>(value));
+            }
+
+            T result()
+            {
+                rethrow();
+                return std::move(*m_value);
+            }
+        };
+
+        template <>
+        class AsyncPromise<void> : public AsyncPromiseBase
+        {
+        public:
+            AsyncTask<void> get_return_object() noexcept;
+
+            void return_void() noexcept
+            {
+            }
+
+            void result()
+            {
+                rethrow();
+            }
+        };
+
+    } // namespace detail
+
+    template <typename T = void>
+    class AsyncTask : private NonCopyable
+    {
+    public:
+        using promise_type = detail::AsyncPromise<T>;
+        using Handle = std::coroutine_handle<promise_type>;
+
+    protected:
+        Handle m_handle;
+
+    public:
+        explicit AsyncTask(Handle handle) noexcept
+            : m_handle(handle)
+        {
+        }
+
+        AsyncTask(AsyncTask&& task) noexcept
+            : m_handle(std::exchange(task.m_handle, nullptr))
+        {
+        }
+
+        AsyncTask& operator = (AsyncTask&& task) noexcept
+        {
+            if (this != &task)
+            {
+                if (m_handle)
+                {
+                    m_handle.destroy();
+                }
+
+                m_handle = std::exchange(task.m_handle, nullptr);
+            }
+            return *this;
+        }
+
+        ~AsyncTask()
+        {
+            if (m_handle)
+            {
+                m_handle.destroy();
+            }
+        }
+
+        bool await_ready() const noexcept
+        {
+            return !m_handle || m_handle.done();
+        }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+        {
+            // start the task; it resumes the awaiting coroutine when it completes
+            m_handle.promise().setContinuation(awaiting);
+            return m_handle;
+        }
+
+        T await_resume()
+        {
+            return m_handle.promise().result();
+        }
+    };
+
+    namespace detail
+    {
+
+        template <typename T>
+        AsyncTask<T> AsyncPromise<T>::get_return_object() noexcept
+        {
+            return AsyncTask<T>(std::coroutine_handle<AsyncPromise<T>>::from_promise(*this));
+        }
+
+        inline AsyncTask<void> AsyncPromise<void>::get_return_object() noexcept
+        {
+            return AsyncTask<void>(std::coroutine_handle<AsyncPromise<void>>::from_promise(*this));
+        }
+
+        // a coroutine which starts immediately and destroys itself when it completes
+        struct DetachedTask
+        {
+            struct promise_type
+            {
+                DetachedTask get_return_object() const noexcept
+                {
+                    return {};
+                }
+
+                std::suspend_never initial_suspend() const noexcept
+                {
+                    return {};
+                }
+
+                std::suspend_never final_suspend() const noexcept
+                {
+                    return {};
+                }
+
+                void return_void() const noexcept
+                {
+                }
+
+                void unhandled_exception() const noexcept
+                {
+                    std::terminate();
+                }
+            };
+        };
+
+        struct SyncWaitEvent
+        {
+            std::mutex mutex;
+            std::condition_variable condition;
+            bool done { false };
+
+            void signal()
+            {
+                // notify while holding the lock; the waiter owns the event and
+                // destroys it as soon as it sees the flag
+                std::lock_guard<std::mutex> lock(mutex);
+                done = true;
+                condition.notify_all();
+            }
+
+            void wait()
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock, [this] {
+                    return done;
+                });
+            }
+        };
+
+        template <typename T>
+        DetachedTask syncWaitStart(AsyncTask<T>& task, std::optional<T>& result, std::exception_ptr& exception, SyncWaitEvent& event)
+        {
+            try
+            {
+                result.emplace(co_await task);
+            }
+            catch (...)
+            {
+                exception = std::current_exception();
+            }
+
+            event.signal();
+        }
+
+        inline DetachedTask syncWaitStart(AsyncTask<void>& task, std::exception_ptr& exception, SyncWaitEvent& event)
+        {
+            try
+            {
+                co_await task;
+            }
+            catch (...)
+            {
+                exception = std::current_exception();
+            }
+
+            event.signal();
+        }
+
+    } // namespace detail
+
+    template <typename T>
+    T syncWait(AsyncTask<T>&& task)
+    {
+        std::optional<T> result;
+        std::exception_ptr exception;
+        detail::SyncWaitEvent event;
+
+        detail::syncWaitStart(task, result, exception, event);
+        event.wait();
+
+        if (exception)
+        {
+            std::rethrow_exception(exception);
+        }
+
+        return std::move(*result);
+    }
+
+    inline void syncWait(AsyncTask<void>&& task)
+    {
+        std::exception_ptr exception;
+        detail::SyncWaitEvent event;
+
+        detail::syncWaitStart(task, exception, event);
+        event.wait();
+
+        if (exception)
+        {
+            std::rethrow_exception(exception);
+        }
+    }
+
+} // namespace mango
+
+#endif // MANGO_ENABLE_COROUTINE
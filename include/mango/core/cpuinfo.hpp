@@ -4,6 +4,7 @@
 */
 #pragma once
 
+#include <vector>
 #include "configure.hpp"
 
 namespace mango
@@ -62,4 +63,36 @@ namespace mango
 
 	u64 getCPUFlags();
 
+	// ----------------------------------------------------------------------------
+	// getCPUTopology()
+	// ----------------------------------------------------------------------------
+
+    /*
+        The logical processors and how they share hardware resources. The core, cache
+        and node indices are dense, starting from zero. On platforms where the topology
+        is not available every logical processor is reported as a separate core which
+        shares one cache domain and one NUMA node with all the others.
+    */
+
+    struct CPUTopology
+    {
+        struct Processor
+        {
+            int id;       // logical processor as numbered by the operating system
+            int core;     // physical core; SMT siblings share the same core
+            int package;  // physical package (socket)
+            int cache;    // last level cache (L3) domain
+            int node;     // NUMA node
+        };
+
+        std::vector<Processor> processors;
+
+        int cores { 0 };
+        int packages { 0 };
+        int caches { 0 };
+        int nodes { 0 };
+    };
+
+    const CPUTopology& getCPUTopology();
+
 } // namespace mango
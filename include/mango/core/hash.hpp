@@ -17,4 +17,27 @@ namespace mango
     u32 xxhash32(Memory memory);
     u64 xxhash64(Memory memory);
 
+    // -----------------------------------------------------------------------
+    // SHA1
+    // -----------------------------------------------------------------------
+
+    // Incremental SHA1 for messages which are not available in one piece.
+    // The hash is in the same format as computed by the sha1() function.
+    // The object can be copied to continue from a common prefix.
+
+    class SHA1
+    {
+    protected:
+        u32 m_state[5];
+        u64 m_length;
+        u8 m_block[64];
+        void (*m_transform)(u32* state, const u8* block, int count);
+
+    public:
+        SHA1();
+
+        void update(Memory memory);
+        void final(u32 hash[5]);
+    };
+
 } // namespace mango
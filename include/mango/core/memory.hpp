@@ -7,6 +7,8 @@
 #include <memory>
 #include <limits>
 #include <algorithm>
+#include <atomic>
+#include <mutex>
 #include "configure.hpp"
 #include "object.hpp"
 
@@ -74,6 +76,182 @@ namespace mango
     void* aligned_malloc(size_t size, size_t alignment = MANGO_DEFAULT_ALIGNMENT);
     void aligned_free(void* aligned);
 
+    // -----------------------------------------------------------------------
+    // large memory allocation
+    // -----------------------------------------------------------------------
+
+    /*
+        large_malloc() allocates directly from the virtual memory system and is meant
+        for large, long-lived storage such as decoded images. The freed blocks are kept
+        in a size-class cache (256 MB by default) and reused, which avoids the page
+        faults of mapping fresh memory for every image.
+
+        Allocation::HUGE_PAGES requests transparent huge pages (madvise) and
+        Allocation::EXPLICIT_HUGE_PAGES tries the reserved huge page pool first
+        (MAP_HUGETLB / MEM_LARGE_PAGES), falling back to transparent huge pages.
+        Allocation::PREFAULT touches the pages of a new mapping in parallel in the
+        ThreadPool, so that the first pass over the memory does not fault. The flags
+        are hints; the allocation works on every platform without them.
+
+        The memory is aligned to at least the page size.
+
+        Usage example:
+
+        Bitmap bitmap(width, height, format, Allocation::HUGE_PAGES | Allocation::PREFAULT);
+
+    */
+
+    enum class Allocation : u32
+    {
+        DEFAULT             = 0x0000, // system allocator
+        LARGE               = 0x0001, // large_malloc()
+        HUGE_PAGES          = 0x0003, // LARGE + transparent huge pages
+        EXPLICIT_HUGE_PAGES = 0x0007, // LARGE + HUGE_PAGES + reserved huge pages
+        PREFAULT            = 0x0009, // LARGE + fault the pages in parallel
+    };
+
+    inline Allocation operator | (Allocation a, Allocation b)
+    {
+        return Allocation(u32(a) | u32(b));
+    }
+
+    inline bool operator & (Allocation a, Allocation b)
+    {
+        return (u32(a) & u32(b)) == u32(b);
+    }
+
+    void* large_malloc(size_t size, Allocation allocation = Allocation::LARGE);
+    void large_free(void* address);
+
+    // maximum number of bytes kept in the cache of freed blocks; zero disables the cache
+    void setLargeMemoryCacheSize(size_t bytes);
+
+    // allocate with new[] or large_malloc() depending on the allocation flags
+    u8* allocate_storage(size_t size, Allocation allocation);
+    void free_storage(u8* address, Allocation allocation);
+
+    // -----------------------------------------------------------------------
+    // Arena
+    // -----------------------------------------------------------------------
+
+    /*
+        Arena is a bump allocator for short-lived memory. The allocations are not
+        freed individually; the memory is reclaimed all at once with release() or
+        reset(). The chunks are kept for reuse, so an arena which is reset between
+        operations stops calling the system allocator (and page faulting) once it has
+        grown to the working set size.
+
+        allocate() is thread-safe; mark(), release() and reset() are not and must not
+        be called while other threads are allocating from the arena.
+
+        Usage example:
+
+        Arena arena;
+
+        parallel_for(queue, 0, count, 64, [&] (int i0, int i1) {
+            float* temp = arena.allocate<float>(1024);
+            // TODO: do your stuff here..
+        });
+
+        arena.reset();
+
+    */
+
+    class Arena : private NonCopyable
+    {
+    protected:
+        struct Chunk;
+
+        std::atomic<Chunk*> m_current;
+        Chunk* m_head;
+        size_t m_chunk_size;
+        std::mutex m_mutex;
+
+        Chunk* grow(Chunk* chunk, size_t bytes, size_t alignment);
+
+    public:
+        struct Marker
+        {
+            Chunk* chunk;
+            size_t offset;
+        };
+
+        explicit Arena(size_t chunkSize = 256 * 1024);
+        ~Arena();
+
+        void* allocate(size_t bytes, size_t alignment = MANGO_DEFAULT_ALIGNMENT);
+
+        template <typename T>
+        T* allocate(size_t count)
+        {
+            const size_t alignment = std::max(alignof(T), size_t(MANGO_DEFAULT_ALIGNMENT));
+            return reinterpret_cast<T*>(allocate(count * sizeof(T), alignment));
+        }
+
+        // the allocations made after mark() are reclaimed with release()
+        Marker mark() const;
+        void release(const Marker& marker);
+        void reset();
+
+        // bytes reserved from the system allocator
+        size_t capacity() const;
+    };
+
+    // -----------------------------------------------------------------------
+    // ScratchScope
+    // -----------------------------------------------------------------------
+
+    /*
+        Every thread has a scratch Arena for temporary memory. ScratchScope allocates
+        from the current thread's arena and releases the allocations when it goes out
+        of scope, so a ThreadPool task (or an image operation) can use scratch memory
+        without touching the system allocator. The scopes must be nested, and the
+        memory must not be used after the scope or from other threads.
+
+        Usage example:
+
+        ConcurrentQueue queue;
+
+        parallel_for(queue, 0, height, 1, [&] (int y0, int y1) {
+            ScratchScope scratch;
+            u8* temp = scratch.allocate<u8>(stride * (y1 - y0));
+            // TODO: do your stuff here..
+        });
+
+    */
+
+    Arena& getScratchArena();
+
+    class ScratchScope : private NonCopyable
+    {
+    protected:
+        Arena& m_arena;
+        Arena::Marker m_marker;
+
+    public:
+        ScratchScope()
+            : m_arena(getScratchArena())
+            , m_marker(m_arena.mark())
+        {
+        }
+
+        ~ScratchScope()
+        {
+            m_arena.release(m_marker);
+        }
+
+        void* allocate(size_t bytes, size_t alignment = MANGO_DEFAULT_ALIGNMENT)
+        {
+            return m_arena.allocate(bytes, alignment);
+        }
+
+        template <typename T>
+        T* allocate(size_t count)
+        {
+            return m_arena.allocate<T>(count);
+        }
+    };
+
     // -----------------------------------------------------------------------
     // aligned memory allocator
     // -----------------------------------------------------------------------
@@ -119,7 +297,7 @@ namespace mango
             return &x;
         }
 
-        pointer allocate(size_type n, std::allocator<void>::const_pointer hint = 0)
+        pointer allocate(size_type n, const void* hint = 0)
         {
             MANGO_UNREFERENCED_PARAMETER(hint);
             void* s = aligned_malloc(n * sizeof(T), MANGO_DEFAULT_ALIGNMENT);
@@ -38,10 +38,25 @@ namespace mango
         virtual void read(void* dest, size_t size) = 0;
         virtual void write(const void* data, size_t size) = 0;
 
+        // gather write: the segments are written in order as if with one write() each
+        virtual void write(const Memory* segments, size_t count)
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                write(segments[i].address, segments[i].size);
+            }
+        }
+
         void write(Memory memory)
         {
             write(memory.address, memory.size);
         }
+
+        // write out the data buffered in the stream; the errors are reported here
+        // since the destructor of a buffered stream has to ignore them
+        virtual void flush()
+        {
+        }
     };
 
     // --------------------------------------------------------------
@@ -138,6 +153,11 @@ namespace mango
             s.write(memory);
         }
 
+        void write(const Memory* segments, size_t count)
+        {
+            s.write(segments, count);
+        }
+
         void write8(u8 value)
         {
             s.write(&value, sizeof(u8));
@@ -272,6 +292,11 @@ namespace mango
             s.write(memory);
         }
 
+        void write(const Memory* segments, size_t count)
+        {
+            s.write(segments, count);
+        }
+
         void write8(u8 value)
         {
             s.write(&value, 1);
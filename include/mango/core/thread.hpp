@@ -5,16 +5,28 @@
 #pragma once
 
 #include <queue>
+#include <deque>
 #include <vector>
+#include <map>
 #include <memory>
 #include <thread>
 #include <mutex>
 #include <functional>
 #include <condition_variable>
 #include <future>
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <type_traits>
+#include "configure.hpp"
 #include "exception.hpp"
 #include "object.hpp"
 #include "atomic.hpp"
+#include "bits.hpp"
+
+#ifdef MANGO_ENABLE_COROUTINE
+#include <coroutine>
+#endif
 
 namespace mango
 {
@@ -81,75 +93,670 @@ namespace mango
         }
     };
 
+    // ----------------------------------------------------------------------------
+    // TaskFunction
+    // ----------------------------------------------------------------------------
+
+    /*
+        TaskFunction is a move-only void() callable for the task queues. Callables up to
+        STORAGE_SIZE bytes are stored inline in the TaskFunction object; larger callables
+        are stored in a slab allocator's size class so that submitting a task does not
+        call malloc. The std::function would need a heap allocation for nearly every
+        lambda capturing more than a couple of pointers.
+    */
+
+    namespace detail
+    {
+        void* allocateTaskStorage(size_t size, size_t alignment);
+        void freeTaskStorage(void* address, size_t size, size_t alignment);
+    } // namespace detail
+
+    class TaskFunction
+    {
+    public:
+        enum { STORAGE_SIZE = 56 };
+
+    protected:
+        struct Operations
+        {
+            void (*invoke)(void* object);
+            void (*move)(void* dest, void* source);
+            void (*destroy)(void* object);
+            bool inline_storage;
+        };
+
+        template <typename F>
+        struct InlineOperations
+        {
+            static void invoke(void* object)
+            {
+                (*reinterpret_cast<F*>(object))();
+            }
+
+            static void move(void* dest, void* source)
+            {
+                new (dest) F(std::move(*reinterpret_cast<F*>(source)));
+                reinterpret_cast<F*>(source)->~F();
+            }
+
+            static void destroy(void* object)
+            {
+                reinterpret_cast<F*>(object)->~F();
+            }
+
+            static const Operations operations;
+        };
+
+        template <typename F>
+        struct HeapOperations
+        {
+            static void invoke(void* object)
+            {
+                (**reinterpret_cast<F**>(object))();
+            }
+
+            static void destroy(void* object)
+            {
+                F* func = *reinterpret_cast<F**>(object);
+                func->~F();
+                detail::freeTaskStorage(func, sizeof(F), alignof(F));
+            }
+
+            static const Operations operations;
+        };
+
+        template <typename F>
+        struct is_inline
+        {
+            static constexpr bool value = sizeof(F) <= STORAGE_SIZE &&
+                                          alignof(F) <= alignof(void*) &&
+                                          std::is_nothrow_move_constructible<F>::value;
+        };
+
+        const Operations* m_operations { nullptr };
+        alignas(void*) u8 m_storage[STORAGE_SIZE];
+
+        template <typename F>
+        void construct(F&& func, std::true_type)
+        {
+            using T = typename std::decay<F>::type;
+            new (m_storage) T(std::forward<F>(func));
+            m_operations = &InlineOperations<T>::operations;
+        }
+
+        template <typename F>
+        void construct(F&& func, std::false_type)
+        {
+            using T = typename std::decay<F>::type;
+            void* address = detail::allocateTaskStorage(sizeof(T), alignof(T));
+            *reinterpret_cast<T**>(m_storage) = new (address) T(std::forward<F>(func));
+            m_operations = &HeapOperations<T>::operations;
+        }
+
+        void moveFrom(TaskFunction& other)
+        {
+            m_operations = other.m_operations;
+            if (m_operations)
+            {
+                if (m_operations->inline_storage)
+                {
+                    m_operations->move(m_storage, other.m_storage);
+                }
+                else
+                {
+                    // just steal the pointer
+                    std::memcpy(m_storage, other.m_storage, sizeof(void*));
+                }
+
+                other.m_operations = nullptr;
+            }
+        }
+
+        void reset()
+        {
+            if (m_operations)
+            {
+                m_operations->destroy(m_storage);
+                m_operations = nullptr;
+            }
+        }
+
+    public:
+        TaskFunction() = default;
+
+        template <typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, TaskFunction>::value>::type>
+        TaskFunction(F&& func)
+        {
+            using T = typename std::decay<F>::type;
+            construct(std::forward<F>(func), std::integral_constant<bool, is_inline<T>::value>());
+        }
+
+        TaskFunction(TaskFunction&& other) noexcept
+        {
+            moveFrom(other);
+        }
+
+        TaskFunction& operator = (TaskFunction&& other) noexcept
+        {
+            if (this != &other)
+            {
+                reset();
+                moveFrom(other);
+            }
+            return *this;
+        }
+
+        TaskFunction(const TaskFunction&) = delete;
+        TaskFunction& operator = (const TaskFunction&) = delete;
+
+        ~TaskFunction()
+        {
+            reset();
+        }
+
+        explicit operator bool () const
+        {
+            return m_operations != nullptr;
+        }
+
+        void operator () ()
+        {
+            m_operations->invoke(m_storage);
+        }
+    };
+
+    template <typename F>
+    const TaskFunction::Operations TaskFunction::InlineOperations<F>::operations =
+    {
+        InlineOperations<F>::invoke,
+        InlineOperations<F>::move,
+        InlineOperations<F>::destroy,
+        true
+    };
+
+    template <typename F>
+    const TaskFunction::Operations TaskFunction::HeapOperations<F>::operations =
+    {
+        HeapOperations<F>::invoke,
+        nullptr,
+        HeapOperations<F>::destroy,
+        false
+    };
+
+    // bind arguments to a callable without going through std::function
+    template <class F>
+    TaskFunction makeTask(F&& f)
+    {
+        return TaskFunction(std::forward<F>(f));
+    }
+
+    template <class F, class A, class... Args>
+    TaskFunction makeTask(F&& f, A&& a, Args&&... args)
+    {
+        return TaskFunction(std::bind(std::forward<F>(f), std::forward<A>(a), std::forward<Args>(args)...));
+    }
+
+    /*
+        EventCount is a condition variable for lock-free code. The waiting thread
+        announces itself with prepareWait(), re-checks the condition it is waiting for
+        and then either calls cancelWait() or goes to sleep with commitWait(). A notify
+        which happens after prepareWait() is never lost, so the condition can be a plain
+        atomic or a lock-free queue instead of state protected by a mutex.
+
+        Usage example:
+
+        for (;;)
+        {
+            if (condition())
+                break;
+
+            u32 key = event.prepareWait();
+            if (condition())
+            {
+                event.cancelWait();
+                break;
+            }
+
+            event.commitWait(key);
+        }
+
+    */
+
+    class EventCount : private NonCopyable
+    {
+    protected:
+        std::atomic<u32> m_epoch { 0 };
+        std::atomic<u32> m_waiters { 0 };
+
+        // used on platforms without futex
+        std::mutex m_mutex;
+        std::condition_variable m_condition;
+
+    public:
+        EventCount() = default;
+        ~EventCount() = default;
+
+        u32 prepareWait();
+        void cancelWait();
+        void commitWait(u32 key);
+
+        // return false if the timeout expired before a notify
+        bool commitWait(u32 key, u32 milliseconds);
+
+        // return true if there were any waiters
+        bool notifyOne();
+        bool notifyAll();
+        bool notify(int count);
+    };
+
+    // ----------------------------------------------------------------------------
+    // ThreadPoolStatistics
+    // ----------------------------------------------------------------------------
+
+    /*
+        The ThreadPool keeps statistics of the queues (by name) and the workers all the
+        time; getStatistics() takes a snapshot. The rates are averages since the first
+        queue with the name was created; the difference between two snapshots gives
+        the rate over that interval. The task counts and the time the workers are
+        parked are always collected, but the task timings (latency, runtime and the
+        busy time spent in tasks) only after setStatistics(true), as they cost three
+        clock reads per task. Without them the latency and runtime histograms are
+        empty and the busy time also includes looking for work; the timing flag in
+        the snapshot tells which is the case. The timings count from the moment they
+        were enabled, so compare snapshots taken while they were on.
+
+        Usage example:
+
+        ThreadPool::getInstance().setStatistics(true);
+
+        // TODO: run the workload
+
+        ThreadPoolStatistics stats = ThreadPool::getInstance().getStatistics();
+
+        for (auto& queue : stats.queues)
+        {
+            printf("%s: %d tasks, wait p50: %d us, run p50: %d us\n", queue.name.c_str(),
+                int(queue.completed), int(queue.latency.percentile(0.5)), int(queue.runtime.percentile(0.5)));
+        }
+
+    */
+
+    struct Histogram
+    {
+        // bucket 0 is for zero, bucket n for [2^(n-1), 2^n) microseconds
+        enum { BUCKETS = 32 };
+
+        u64 count[BUCKETS];
+        u64 sum; // microseconds
+
+        Histogram()
+        {
+            std::memset(this, 0, sizeof(Histogram));
+        }
+
+        static int bucket(u64 microseconds)
+        {
+            if (!microseconds)
+                return 0;
+            return std::min(u64_log2(microseconds) + 1, int(BUCKETS - 1));
+        }
+
+        u64 samples() const
+        {
+            u64 total = 0;
+            for (int i = 0; i < BUCKETS; ++i)
+                total += count[i];
+            return total;
+        }
+
+        u64 average() const
+        {
+            u64 total = samples();
+            return total ? sum / total : 0;
+        }
+
+        // upper bound of the bucket which contains the given fraction of the samples
+        u64 percentile(double fraction) const
+        {
+            const u64 target = u64(samples() * fraction);
+            u64 total = 0;
+
+            for (int i = 0; i < BUCKETS; ++i)
+            {
+                total += count[i];
+                if (count[i] && total >= target)
+                    return i ? u64(1) << i : 0;
+            }
+
+            return 0;
+        }
+    };
+
+    struct QueueStatistics
+    {
+        std::string name;
+        u64 enqueued = 0;
+        u64 started = 0;
+        u64 completed = 0;
+        u64 cancelled = 0;      // skipped by cancel() or the deadline
+        double throughput = 0;  // completed tasks per second
+        Histogram latency;      // enqueue to start
+        Histogram runtime;      // start to completion
+    };
+
+    struct WorkerStatistics
+    {
+        u64 tasks = 0;
+        u64 steals = 0;         // tasks taken from other workers
+        u64 sleeps = 0;         // times the worker was parked
+        u64 busy = 0;           // microseconds spent in tasks (without timing: not parked)
+        u64 idle = 0;           // microseconds spent looking for work or parked (without timing: parked)
+        u64 parked = 0;         // microseconds spent parked
+
+        double utilization() const
+        {
+            u64 total = busy + idle;
+            return total ? double(busy) / double(total) : 0.0;
+        }
+    };
+
+    struct ThreadPoolStatistics
+    {
+        u64 time = 0;           // microseconds since the pool was created
+        u64 wakeups = 0;        // parked workers woken up by new work
+        bool timing = false;    // the task timings were collected (setStatistics)
+        std::vector<QueueStatistics> queues;
+        std::vector<WorkerStatistics> workers;
+    };
+
     struct TaskQueue;
+    struct QueueTasks;
+    struct WorkStealingQueue;
+    struct CurrentTask;
+    struct QueueCounters;
+    struct WorkerCounters;
 
     class ThreadPool : private NonCopyable
     {
     private:
         friend struct TaskQueue;
+        friend struct QueueTasks;
+        friend struct WorkStealingQueue;
+        friend struct CurrentTask;
         friend class ConcurrentQueue;
         friend class SerialQueue;
+        friend class CancellationToken;
+
+        struct Queue;
+
+        // the cancellation state is shared with the tokens so that they can outlive the queue
+        struct CancelState : std::enable_shared_from_this<CancelState>
+        {
+            std::atomic<int> stamp_cancel { -1 };
+            std::atomic<u64> deadline { 0 }; // microseconds; tasks not started by then are skipped (0: none)
+
+            bool isCancelled(int stamp) const;
+        };
+
+        struct Task
+        {
+            Queue* queue;
+            int stamp;
+            bool limited { false }; // counted in the queue's running tasks
+            u64 time;               // enqueue time in microseconds
+            TaskFunction func;
+        };
 
         struct Queue
         {
             ThreadPool* pool;
             int priority;
+            int node;
             std::atomic<int> task_input_count;
             std::atomic<int> task_complete_count;
-            std::atomic<int> stamp_cancel;
-            std::string name;
+            std::shared_ptr<CancelState> cancel;
+            QueueCounters* counters;
+
+            // scheduling between the queues with the same priority
+            QueueTasks* tasks { nullptr };  // lock-free store of the tasks waiting for a worker
+            std::atomic<int> waiting;       // tasks in the store
+            std::atomic<int> weight;        // tasks dequeued in one round-robin turn
+            int deficit;                    // tasks left in the current turn; protected by the list lock
+            std::atomic<int> limit;         // maximum number of running tasks (0: no limit)
+            std::atomic<int> running;       // running tasks (counted only with a limit)
+            std::atomic<bool> scheduled;    // the queue is in the round-robin list
+
+            ~Queue();
 
             bool empty() const
             {
                 return task_input_count.load() == task_complete_count.load();
             }
+
+            bool runnable() const
+            {
+                const int max = limit.load();
+                return !max || running.load() < max;
+            }
         };
 
-        struct Task
+    public:
+        enum class Affinity
         {
-            Queue* queue;
-            int stamp;
-            std::function<void()> func;
+            NONE,   // the operating system decides where the workers run
+            CORE,   // each worker runs on one physical core (and it's SMT siblings)
+            CACHE   // each worker runs on the processors sharing one last level cache
         };
 
-    public:
-        ThreadPool(size_t size);
+        ThreadPool(size_t size, Affinity affinity = Affinity::NONE);
         ~ThreadPool();
 
+        // The default pool is created on first use. The size and affinity can be
+        // configured with configureInstance() before that, or with the MANGO_THREADS
+        // ("8") and MANGO_THREAD_AFFINITY ("none", "core", "cache") environment variables.
+        // The configureInstance() overrides the environment variables and throws
+        // an exception if the default pool has already been created.
+        static void configureInstance(size_t size, Affinity affinity = Affinity::NONE);
         static ThreadPool& getInstance();
         static int getInstanceSize();
 
         int size() const;
 
-        void enqueue(std::function<void()>&& func)
+        // number of NUMA nodes the workers are pinned to; 1 without affinity
+        int nodes() const;
+
+        ThreadPoolStatistics getStatistics() const;
+
+        // collect the task timings; disabled by default
+        void setStatistics(bool enable);
+
+        // Lower priority work is run ahead of higher priority work when it has not been
+        // scheduled for the aging period (NORMAL) or twice the aging period (LOW), so
+        // that a steady stream of HIGH priority tasks cannot starve it. Zero disables aging.
+        void setAgingPeriod(int milliseconds);
+
+        void enqueue(TaskFunction&& func)
         {
             enqueue(m_static_queue, std::move(func));
         }
 
+#ifdef MANGO_ENABLE_COROUTINE
+
+        class ScheduleAwaiter
+        {
+        protected:
+            ThreadPool& m_pool;
+
+        public:
+            ScheduleAwaiter(ThreadPool& pool)
+                : m_pool(pool)
+            {
+            }
+
+            bool await_ready() const noexcept
+            {
+                return false;
+            }
+
+            void await_suspend(std::coroutine_handle<> handle)
+            {
+                m_pool.enqueue([handle] {
+                    handle.resume();
+                });
+            }
+
+            void await_resume() const noexcept
+            {
+            }
+        };
+
+        // continue the calling coroutine in a worker thread: co_await pool.schedule();
+        ScheduleAwaiter schedule()
+        {
+            return ScheduleAwaiter(*this);
+        }
+
+#endif
+
     protected:
         void thread(size_t threadID);
 
-        Queue* createQueue(const std::string& name, int priority);
+        Queue* createQueue(const std::string& name, int priority, int node = -1);
+        QueueCounters* getQueueCounters(const std::string& name);
+        size_t getSharedQueueIndex(const Queue* queue) const;
         void deleteQueue(Queue* queue);
 
-        void enqueue(Queue* queue, std::function<void()>&& func);
+        void configure(Queue* queue, int weight, int limit);
+        void schedule(Queue* queue);
+        bool activate(Queue* queue);
+        void wakeup(int count);
+
+        void enqueue(Queue* queue, TaskFunction&& func);
+        void enqueue_bulk(Queue* queue, Task* tasks, size_t count);
+        void enqueue_shared(Queue* queue, Task* tasks, size_t count);
+        void enqueue_update(int priority, size_t count);
         bool dequeue_and_process();
+        bool dequeue(size_t priority, Task& task);
+        bool dequeue_shared(size_t index, Task& task);
+        bool steal(size_t priority, Task& task);
+        void process(Task& task);
         void cancel(Queue* queue);
+        void setDeadline(Queue* queue, u32 milliseconds);
         void wait(Queue* queue);
+        bool wait_for(Queue* queue, u32 milliseconds);
 
     private:
         alignas(64) ObjectCache<Queue> m_queue_cache;
         alignas(64) TaskQueue* m_queues;
+        WorkStealingQueue* m_local_queues;
+
+        // the shared queues are grouped by node; group 0 is for tasks without node preference
+        int m_node_count;
+        std::vector<int> m_worker_node;
+
+        // aging: tasks waiting for a worker and the last time a task was started, per priority
+        std::atomic<int> m_pending[3];
+        std::atomic<u64> m_served[3];
+        std::atomic<u64> m_aging_period;
 
         std::atomic<bool> m_stop { false };
-        std::atomic<int> m_sleep_count { 0 };
-        std::mutex m_queue_mutex;
-        std::condition_variable m_condition;
+        EventCount m_idle_event;
+        EventCount m_wait_event;  // wait(); also recruits a helper when tasks are enqueued
+        EventCount m_drain_event; // wait_for(); notified only when a queue drains
+
+        // statistics; the queue counters are shared by all queues with the same name
+        u64 m_start_time;
+        std::atomic<bool> m_timing { false };
+        mutable std::mutex m_counters_mutex;
+        std::map<std::string, std::unique_ptr<QueueCounters>> m_queue_counters;
+
+        // lock-free index of the queue counters by name hash; the entries are never removed
+        enum { COUNTERS_INDEX_SIZE = 256, COUNTERS_INDEX_PROBES = 8 };
+        std::atomic<QueueCounters*> m_counters_index[COUNTERS_INDEX_SIZE];
+        WorkerCounters* m_worker_counters;
+        std::atomic<u64> m_wakeups { 0 };
 
         Queue* m_static_queue;
         std::vector<std::thread> m_threads;
     };
 
+    /*
+        CancellationToken tells a running task that it's result is no longer needed.
+        The ThreadPool skips the tasks which have not started when their queue is
+        cancelled or it's deadline expires; long running tasks can poll the token
+        to stop early. The token of the task running on the current thread is
+        available with CancellationToken::current(); a default constructed token is
+        never cancelled. ConcurrentQueue passes the token as argument to tasks which
+        accept one.
+
+        The token shares the cancellation state with the queue; it remains valid
+        after the queue is destroyed and reports the state the queue was left in.
+
+        Usage example:
+
+        ConcurrentQueue q;
+
+        q.enqueue([] (const CancellationToken& token) {
+            for (int y = 0; y < height; ++y)
+            {
+                if (token.isCancelled())
+                    break;
+
+                // TODO: process scanline y
+            }
+        });
+
+        q.cancel();
+
+    */
+
+    class CancellationToken
+    {
+    protected:
+        std::shared_ptr<const ThreadPool::CancelState> m_state;
+        int m_stamp { 0 };
+
+    public:
+        CancellationToken() = default;
+        CancellationToken(std::shared_ptr<const ThreadPool::CancelState> state, int stamp)
+            : m_state(std::move(state))
+            , m_stamp(stamp)
+        {
+        }
+
+        static CancellationToken current();
+
+        bool isCancelled() const;
+    };
+
+    namespace detail
+    {
+        template <typename F, typename = void>
+        struct accepts_token : std::false_type
+        {
+        };
+
+        template <typename F>
+        struct accepts_token<F, decltype(void(std::declval<F&>()(std::declval<const CancellationToken&>())))> : std::true_type
+        {
+        };
+
+        template <class F>
+        TaskFunction makeQueueTask(F&& f, std::true_type)
+        {
+            return TaskFunction([func = std::forward<F>(f)] () mutable {
+                func(CancellationToken::current());
+            });
+        }
+
+        template <class F>
+        TaskFunction makeQueueTask(F&& f, std::false_type)
+        {
+            return makeTask(std::forward<F>(f));
+        }
+
+    } // namespace detail
+
     enum class Priority
     {
         HIGH = 0,
@@ -159,24 +766,55 @@ namespace mango
 
     /*
         ConcurrentQueue is API to submit work into the ThreadPool. The tasks have no
-        dependency to each other and can be executed in any order. Any number of queues
+        dependency to each other and can be executed in any order (see TaskGraph for
+        tasks which depend on other tasks). Any number of queues
         can be created from any thread in the program. The ThreadPool is shared between
         queues. The queues can be configuted to different priorities to control which tasks
-        are more time critical.
+        are more time critical. A queue can prefer workers on a NUMA node when the
+        ThreadPool pins it's workers; other workers take the tasks only when they are idle.
+
+        The queues use the default ThreadPool unless another pool is given. Work in
+        separate pools does not compete for the same workers, for example a latency
+        critical decoder and a background archiver can have a pool each.
+
+        Queues with the same priority share the workers round-robin; a queue with a
+        larger weight gets proportionally more tasks started per turn. The concurrency
+        limit caps how many of the queue's tasks run at the same time. Tasks enqueued
+        from inside a task of the same pool run on the current worker first and are not
+        part of the round-robin unless the queue has a concurrency limit.
 
         Usage example:
 
         // create queue
         ConcurrentQueue q;
 
+        // create queue in a separate pool
+        ThreadPool io_pool(2);
+        ConcurrentQueue io(io_pool, "io");
+
         // submit work into the queue
         q.enqueue([] {
             // TODO: do your stuff here..
         });
 
+        // submit many tasks at once; cheaper than enqueue() in a loop
+        q.enqueue_n(count, [] (int index) {
+            // TODO: do your stuff here..
+        });
+
+        // background work which gets at most two workers
+        ConcurrentQueue thumbnails("thumbnails", Priority::LOW);
+        thumbnails.setConcurrency(2);
+
         // wait until the queue is drained
         q.wait();
 
+        // give up waiting after 100 ms and stop the remaining work
+        if (!q.wait_for(100))
+        {
+            q.cancel();
+        }
+
     */
 
     class ConcurrentQueue : private NonCopyable
@@ -187,23 +825,173 @@ namespace mango
 
     public:
         ConcurrentQueue();
-        ConcurrentQueue(const std::string& name, Priority priority = Priority::NORMAL);
+        ConcurrentQueue(const std::string& name, Priority priority = Priority::NORMAL, int node = -1);
+        ConcurrentQueue(ThreadPool& pool, const std::string& name, Priority priority = Priority::NORMAL, int node = -1);
         ~ConcurrentQueue();
 
+        ThreadPool& pool() const
+        {
+            return m_pool;
+        }
+
+        const std::string& name() const;
+        Priority priority() const;
+        int node() const;
+
+        // share of the workers relative to the other queues with the same priority (default: 1)
+        void setWeight(int weight);
+
+        // maximum number of tasks from this queue running at the same time (0: no limit)
+        void setConcurrency(int limit);
+
+        template <class F>
+        void enqueue(F&& f)
+        {
+            using T = typename std::decay<F>::type;
+            m_pool.enqueue(m_queue, detail::makeQueueTask(std::forward<F>(f), detail::accepts_token<T>()));
+        }
+
+        template <class F, class A, class... Args>
+        void enqueue(F&& f, A&& a, Args&&... args)
+        {
+            m_pool.enqueue(m_queue, makeTask(std::forward<F>(f), std::forward<A>(a), std::forward<Args>(args)...));
+        }
+
+        // enqueue a copy of every callable in [first, last) in one operation
+        template <class Iterator>
+        void enqueue_bulk(Iterator first, Iterator last)
+        {
+            std::vector<ThreadPool::Task> tasks;
+
+            for ( ; first != last; ++first)
+            {
+                tasks.emplace_back();
+                tasks.back().func = *first;
+            }
+
+            m_pool.enqueue_bulk(m_queue, tasks.data(), tasks.size());
+        }
+
+        // enqueue tasks f(0), f(1), .. f(count - 1) in one operation
+        template <class F>
+        void enqueue_n(int count, F&& f)
+        {
+            std::vector<ThreadPool::Task> tasks(std::max(count, 0));
+
+            for (int i = 0; i < count; ++i)
+            {
+                tasks[i].func = [f, i] {
+                    f(i);
+                };
+            }
+
+            m_pool.enqueue_bulk(m_queue, tasks.data(), tasks.size());
+        }
+
+        // skip the tasks which have not started in the given time and cancel the running
+        // tasks' tokens; the deadline applies to tasks enqueued before and after the call (0: none)
+        void setDeadline(u32 milliseconds);
+
+        void cancel();
+        void wait();
+
+        // return false if the queue was not drained in the given time; the
+        // calling thread does not process tasks while waiting
+        bool wait_for(u32 milliseconds);
+    };
+
+    /*
+        TaskGraph is API to submit tasks which depend on other tasks into the ThreadPool.
+        A task is scheduled automatically when all of it's predecessors have completed;
+        tasks without predecessors are scheduled immediately. Tasks can be added from
+        any thread at any time, including from other tasks in the same graph. The graph
+        does not wait between stages, so a pipeline can process different parts of the
+        data in different stages at the same time.
+
+        A task's function is released when it has run, but the nodes remain valid
+        predecessors until the graph is destroyed. An exception thrown by a task
+        cancels the graph and is rethrown by wait(). cancel() drops the tasks which
+        have not started and the tasks added after it until wait() returns; the
+        graph can then be reused, but tasks depending on the dropped nodes never run.
+
+        Usage example:
+
+        // create graph
+        TaskGraph graph("pipeline");
+
+        // submit independent work into the graph
+        TaskGraph::Node a = graph.enqueue([] {
+            // TODO: first stage..
+        });
+
+        TaskGraph::Node b = graph.enqueue([] {
+            // TODO: first stage..
+        });
+
+        // submit work which starts after a and b have completed
+        graph.enqueueAfter({ a, b }, [] {
+            // TODO: second stage..
+        });
+
+        // wait until all tasks in the graph have completed
+        graph.wait();
+
+    */
+
+    struct TaskGraphNode;
+
+    class TaskGraph : private NonCopyable
+    {
+    public:
+        using Node = TaskGraphNode*;
+
+    protected:
+        ConcurrentQueue m_queue;
+        SpinLock m_lock;
+        std::vector<Node> m_nodes;
+        std::atomic<bool> m_cancelled { false };
+        std::exception_ptr m_exception; // first exception thrown by a task; protected by m_lock
+
+        Node createNode(TaskFunction&& func);
+        void submit(Node node, const std::vector<Node>& predecessors);
+        void schedule(Node node);
+        void execute(Node node);
+
+    public:
+        TaskGraph();
+        TaskGraph(const std::string& name, Priority priority = Priority::NORMAL);
+        TaskGraph(ThreadPool& pool, const std::string& name, Priority priority = Priority::NORMAL);
+        ~TaskGraph();
+
         template <class F, class... Args>
-        void enqueue(F&& f, Args&&... args)
+        Node enqueue(F&& f, Args&&... args)
+        {
+            Node node = createNode(makeTask(std::forward<F>(f), std::forward<Args>(args)...));
+            submit(node, std::vector<Node>());
+            return node;
+        }
+
+        // null predecessors are ignored
+        template <class F, class... Args>
+        Node enqueueAfter(const std::vector<Node>& predecessors, F&& f, Args&&... args)
         {
-            m_pool.enqueue(m_queue, std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+            Node node = createNode(makeTask(std::forward<F>(f), std::forward<Args>(args)...));
+            submit(node, predecessors);
+            return node;
         }
 
         void cancel();
+
+        // wait until all scheduled tasks have completed and end the cancellation;
+        // rethrows the first exception thrown by a task
         void wait();
     };
 
     /*
         SerialQueue is API to serialize tasks to be executed after previous task
-        in the queue has completed. The tasks are NOT executed in the ThreadPool; each
-        queue has it's own execution thread.
+        in the queue has completed. The tasks are executed in the ThreadPool one at
+        a time in the order they were enqueued; the queue does not have a thread of
+        it's own, so any number of serial queues can be created cheaply.
 
         SerialQueue and ConcurrentQueue can be freely mixed can can enqueue work to other
         queues from their tasks.
@@ -219,44 +1007,55 @@ namespace mango
         });
 
         // wait until the queue is drained
-        s.wait(); // non-cooperative, CPU-sink
+        s.wait();
 
     */
 
+    struct SerialTaskNode;
+
     class SerialQueue : private NonCopyable
     {
     protected:
-        using Task = std::function<void()>;
+        ThreadPool& m_pool;
+        ThreadPool::Queue* m_queue;
 
-        std::string m_name;
-        std::thread m_thread;
-        std::atomic<bool> m_stop { false };
-        std::atomic<int> m_task_counter { 0 };
+        // lock-free MPSC queue; producers push at the head, the running task pops at the tail
+        std::atomic<SerialTaskNode*> m_head;
+        SerialTaskNode* m_tail;
 
-        std::deque<Task> m_task_queue;
-        std::mutex m_queue_mutex;
-        std::condition_variable m_condition;
+        // tasks which have been enqueued but not completed; the queue is scheduled
+        // into the ThreadPool when this goes up from zero
+        std::atomic<int> m_task_counter { 0 };
+        std::atomic<int> m_task_input { 0 };
+        std::atomic<int> m_stamp_cancel { -1 };
 
-        void thread();
+        void initialize(const std::string& name);
+        void push(TaskFunction&& func);
+        void drain();
 
     public:
         SerialQueue();
         SerialQueue(const std::string& name);
+        SerialQueue(ThreadPool& pool, const std::string& name);
         ~SerialQueue();
 
         template <class F, class... Args>
         void enqueue(F&& f, Args&&... args)
         {
-            std::unique_lock<std::mutex> lock(m_queue_mutex);
-            m_task_queue.emplace_back(f, (args)...);
-            ++m_task_counter;
-            m_condition.notify_one();
+            push(makeTask(std::forward<F>(f), std::forward<Args>(args)...));
         }
 
         void cancel();
         void wait();
     };
 
+    namespace detail
+    {
+        // the first argument selects the pool instead of being the task
+        template <typename F>
+        using enable_if_not_pool = typename std::enable_if<!std::is_same<typename std::decay<F>::type, ThreadPool>::value>::type;
+    } // namespace detail
+
     /*
         Task is a simple queue-less convenience object to enqueue work into the ThreadPool.
         Synchronization must be done manually.
@@ -265,11 +1064,17 @@ namespace mango
     class Task
     {
     public:
-        template <class F, class... Args>
+        template <class F, class... Args, typename = detail::enable_if_not_pool<F>>
         Task(F&& f, Args&&... args)
         {
             ThreadPool& pool = ThreadPool::getInstance();
-            pool.enqueue(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+            pool.enqueue(makeTask(std::forward<F>(f), std::forward<Args>(args)...));
+        }
+
+        template <class F, class... Args>
+        Task(ThreadPool& pool, F&& f, Args&&... args)
+        {
+            pool.enqueue(makeTask(std::forward<F>(f), std::forward<Args>(args)...));
         }
     };
 
@@ -289,6 +1094,12 @@ namespace mango
         // this will block until the task has been completed
         int x = task.get();
 
+        // the task can be enqueued into a specific pool
+        ThreadPool pool(2);
+        FutureTask<int> task2(pool, [] () -> int {
+            return 8;
+        });
+
     */
 
     template <typename T>
@@ -297,25 +1108,28 @@ namespace mango
     private:
         using Future = std::future<T>;
         using Promise = std::promise<T>;
-        using Function = std::function<T()>;
 
         Promise m_promise;
         Future m_future;
 
     public:
-        template <class F, class... Args>
+        template <class F, class... Args, typename = detail::enable_if_not_pool<F>>
         FutureTask(F&& f, Args&&... args)
+            : FutureTask(ThreadPool::getInstance(), std::forward<F>(f), std::forward<Args>(args)...)
+        {
+        }
+
+        template <class F, class... Args>
+        FutureTask(ThreadPool& pool, F&& f, Args&&... args)
             : m_promise()
             , m_future(m_promise.get_future())
         {
-            Function func = std::bind(std::forward<F>(f), std::forward<Args>(args)...);
-            auto container = std::bind([this] (Function func) {
+            auto func = std::bind(std::forward<F>(f), std::forward<Args>(args)...);
+
+            pool.enqueue([this, func = std::move(func)] () mutable {
                 T value = func();
                 m_promise.set_value(value);
-            }, func);
-
-            ThreadPool& pool = ThreadPool::getInstance();
-            pool.enqueue(container);
+            });
         }
 
         T get()
@@ -335,25 +1149,28 @@ namespace mango
     private:
         using Future = std::future<void>;
         using Promise = std::promise<void>;
-        using Function = std::function<void()>;
 
         Promise m_promise;
         Future m_future;
 
     public:
-        template <class F, class... Args>
+        template <class F, class... Args, typename = detail::enable_if_not_pool<F>>
         FutureTask(F&& f, Args&&... args)
+            : FutureTask(ThreadPool::getInstance(), std::forward<F>(f), std::forward<Args>(args)...)
+        {
+        }
+
+        template <class F, class... Args>
+        FutureTask(ThreadPool& pool, F&& f, Args&&... args)
             : m_promise()
             , m_future(m_promise.get_future())
         {
-            Function func = std::bind(std::forward<F>(f), std::forward<Args>(args)...);
-            auto container = std::bind([this] (Function func) {
+            auto func = std::bind(std::forward<F>(f), std::forward<Args>(args)...);
+
+            pool.enqueue([this, func = std::move(func)] () mutable {
                 func();
                 m_promise.set_value();
-            }, func);
-
-            ThreadPool& pool = ThreadPool::getInstance();
-            pool.enqueue(container);
+            });
         }
 
         void get()
@@ -367,4 +1184,164 @@ namespace mango
         }
     };
 
+    /*
+        parallel_for() and parallel_reduce() split a range of integers into pieces which
+        are processed in the ThreadPool. The range is first divided between the workers
+        and then split recursively in half; the upper half is enqueued and the lower half
+        is split further by the same thread.
+        Idle workers steal the largest pending pieces first, so the work balances itself
+        without knowing how expensive the individual items are.
+
+        The grain is the smallest piece the range is split into. The range is not split
+        finer than needed to give every worker a few pieces of work, so a grain of 1
+        means "choose automatically". Small ranges are processed on the calling thread.
+
+        The function is called with a sub-range [begin, end) and must be safe to call
+        concurrently. The calls return when the whole range has been processed.
+
+        The pieces go into a queue of their own with the name, priority and node of the
+        given queue, so the call waits only for it's own pieces and can be made from a
+        task running in that queue. The weight, concurrency limit, deadline and cancel()
+        of the given queue do not apply to the pieces.
+
+        Usage example:
+
+        ConcurrentQueue queue("rows", Priority::HIGH);
+
+        parallel_for(queue, 0, height, 1, [&] (int y0, int y1) {
+            for (int y = y0; y < y1; ++y)
+            {
+                // TODO: process scanline y
+            }
+        });
+
+        int sum = parallel_reduce(queue, 0, count, 1024, 0, [&] (int i0, int i1) {
+            int s = 0;
+            for (int i = i0; i < i1; ++i)
+                s += values[i];
+            return s;
+        }, [] (int a, int b) {
+            return a + b;
+        });
+
+    */
+
+    // size of the pieces parallel_for() splits a range of count items into
+    inline int parallel_grain(const ThreadPool& pool, int count, int grain = 1)
+    {
+        // a few pieces per worker leaves only a small tail for the last piece
+        const int pieces = std::max(pool.size(), 1) * 8;
+        return std::max(std::max(grain, 1), count / pieces);
+    }
+
+    inline int parallel_grain(int count, int grain = 1)
+    {
+        return parallel_grain(ThreadPool::getInstance(), count, grain);
+    }
+
+    namespace detail
+    {
+
+        template <typename F>
+        void parallel_for_split(ConcurrentQueue& queue, int begin, int end, int grain, const F& func)
+        {
+            while (end - begin > grain)
+            {
+                const int middle = begin + (end - begin) / 2;
+
+                queue.enqueue([&queue, middle, end, grain, &func] {
+                    parallel_for_split(queue, middle, end, grain, func);
+                });
+
+                end = middle;
+            }
+
+            func(begin, end);
+        }
+
+        // process the range in a queue which has no other tasks
+        template <typename F>
+        void parallel_for_queue(ConcurrentQueue& queue, int begin, int end, int grain, const F& func)
+        {
+            const int count = end - begin;
+            if (count <= 0)
+                return;
+
+            grain = parallel_grain(queue.pool(), count, grain);
+
+            const int workers = queue.pool().size();
+
+            if (count <= grain || workers < 2)
+            {
+                // not worth the trouble
+                func(begin, end);
+                return;
+            }
+
+            // hand one piece to every worker in one operation; the pieces are split further
+            // so that the workers which finish first can steal from the others
+            const int pieces = std::min(workers, (count + grain - 1) / grain);
+
+            queue.enqueue_n(pieces, [&queue, begin, count, pieces, grain, &func] (int i) {
+                const int first = begin + int(s64(count) * i / pieces);
+                const int last = begin + int(s64(count) * (i + 1) / pieces);
+                parallel_for_split(queue, first, last, grain, func);
+            });
+
+            queue.wait();
+        }
+
+    } // namespace detail
+
+    template <typename F>
+    void parallel_for(ConcurrentQueue& queue, int begin, int end, int grain, F&& func)
+    {
+        // waiting for the caller's queue would include it's unrelated tasks, and the
+        // caller itself when it is a task in that queue
+        ConcurrentQueue pieces(queue.pool(), queue.name(), queue.priority(), queue.node());
+        detail::parallel_for_queue(pieces, begin, end, grain, func);
+    }
+
+    template <typename F>
+    void parallel_for(int begin, int end, int grain, F&& func)
+    {
+        ConcurrentQueue queue("parallel.for", Priority::NORMAL);
+        detail::parallel_for_queue(queue, begin, end, grain, func);
+    }
+
+    template <typename T, typename F, typename R>
+    T parallel_reduce(ConcurrentQueue& queue, int begin, int end, int grain, T identity, F&& func, R&& reduce)
+    {
+        // partial results are combined in range order so that the result does not
+        // depend on the scheduling (floating point addition is not associative)
+        std::vector<std::pair<int, T>> partials;
+        SpinLock lock;
+
+        parallel_for(queue, begin, end, grain, [&] (int first, int last) {
+            T value = func(first, last);
+            SpinLockGuard guard(lock);
+            partials.emplace_back(first, std::move(value));
+        });
+
+        std::sort(partials.begin(), partials.end(), [] (const std::pair<int, T>& a, const std::pair<int, T>& b) {
+            return a.first < b.first;
+        });
+
+        T result = identity;
+
+        for (auto& partial : partials)
+        {
+            result = reduce(result, partial.second);
+        }
+
+        return result;
+    }
+
+    template <typename T, typename F, typename R>
+    T parallel_reduce(int begin, int end, int grain, T identity, F&& func, R&& reduce)
+    {
+        ConcurrentQueue queue("parallel.reduce", Priority::NORMAL);
+        return parallel_reduce(queue, begin, end, grain, identity, std::forward<F>(func), std::forward<R>(reduce));
+    }
+
 } // namespace mango
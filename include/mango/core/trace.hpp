@@ -0,0 +1,94 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2019 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#pragma once
+
+#include <string>
+#include "configure.hpp"
+#include "object.hpp"
+
+namespace mango
+{
+
+    /*
+        Trace records timed scopes into per-thread ring buffers and writes them as
+        Chrome trace JSON, which can be viewed in chrome://tracing or in the Perfetto UI.
+        The library's hot paths are instrumented with MANGO_TRACE_SCOPE(), which
+        compiles to nothing unless MANGO_ENABLE_TRACE is defined (ENABLE_TRACE option
+        in the CMake build). When compiled in, a scope costs one relaxed load while the
+        recording is not running.
+
+        The category and name must be string literals (or otherwise outlive the trace).
+
+        Usage example:
+
+        startTrace();
+
+        {
+            MANGO_TRACE_SCOPE("app", "load");
+            // TODO: do your stuff here..
+        }
+
+        stopTrace("trace.json");
+
+    */
+
+    // begin recording; the events of a previous recording are discarded
+    void startTrace();
+
+    // stop recording and write the events into a Chrome trace JSON file
+    void stopTrace(const std::string& filename);
+
+    bool isTraceRecording();
+
+    // name of the current thread in the trace
+    void setTraceThreadName(const std::string& name);
+
+    u64 getTraceTime();
+    void recordTraceEvent(const char* category, const char* name, u64 time, u64 duration);
+
+    class TraceScope : private NonCopyable
+    {
+    protected:
+        const char* m_category;
+        const char* m_name;
+        u64 m_time;
+        bool m_recording;
+
+    public:
+        TraceScope(const char* category, const char* name)
+            : m_category(category)
+            , m_name(name)
+            , m_time(0)
+            , m_recording(isTraceRecording())
+        {
+            if (m_recording)
+            {
+                m_time = getTraceTime();
+            }
+        }
+
+        ~TraceScope()
+        {
+            if (m_recording)
+            {
+                recordTraceEvent(m_category, m_name, m_time, getTraceTime() - m_time);
+            }
+        }
+    };
+
+} // namespace mango
+
+#ifdef MANGO_ENABLE_TRACE
+
+    #define MANGO_TRACE_CONCATENATE_(a, b) a##b
+    #define MANGO_TRACE_CONCATENATE(a, b) MANGO_TRACE_CONCATENATE_(a, b)
+    #define MANGO_TRACE_SCOPE(category, name) \
+        mango::TraceScope MANGO_TRACE_CONCATENATE(trace_scope_, __LINE__)(category, name)
+
+#else
+
+    #define MANGO_TRACE_SCOPE(category, name)
+
+#endif
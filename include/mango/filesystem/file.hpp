@@ -12,9 +12,31 @@
 #include "mapper.hpp"
 #include "path.hpp"
 
+#ifdef MANGO_ENABLE_COROUTINE
+#include "../core/coroutine.hpp"
+#endif
+
 namespace mango {
 namespace filesystem {
 
+    /*
+        File maps a whole file by default. A range of the file can be mapped instead;
+        compressed files in containers are then decoded only up to the end of the range,
+        which is enough for example to read the image headers in an archive.
+
+        Usage example:
+
+        Path path("images.zip/");
+
+        for (auto& node : path)
+        {
+            File file(path, node.name, 0, 64 * 1024);
+            ImageDecoder decoder(file, getExtension(node.name));
+            ImageHeader header = decoder.header();
+        }
+
+    */
+
     class File : protected NonCopyable
     {
     protected:
@@ -27,6 +49,7 @@ namespace filesystem {
     public:
         File(const std::string& filename);
         File(const Path& path, const std::string& filename);
+        File(const Path& path, const std::string& filename, u64 offset, u64 size);
         File(const Memory& memory, const std::string& extension, const std::string& filename);
         ~File();
 
@@ -40,23 +63,120 @@ namespace filesystem {
         size_t size() const;
     };
 
+    /*
+        FileStream writes through a large aligned buffer. The flags are hints for
+        writing big files: DIRECT bypasses the page cache (O_DIRECT) and ASYNC
+        overlaps the writes with filling the next buffer using io_uring. Both fall
+        back to regular writes when the platform or filesystem does not support them.
+
+        The buffered data is written by flush() and the destructor; call flush() when
+        the file is complete as the destructor cannot report a failed write.
+
+        Usage example:
+
+        FileStream file("archive.bin", Stream::WRITE, FileStream::DIRECT | FileStream::ASYNC);
+        file.write(data, size);
+        file.flush();
+
+    */
+
     class FileStream : public Stream
     {
     protected:
 		struct FileHandle* m_handle;
 
     public:
-        FileStream(const std::string& filename, OpenMode mode);
+        enum Flags : u32
+        {
+            BUFFERED = 0x0000,
+            DIRECT   = 0x0001,
+            ASYNC    = 0x0002,
+        };
+
+        FileStream(const std::string& filename, OpenMode mode, u32 flags = BUFFERED);
         ~FileStream();
 
         const std::string& filename() const;
 
+        using Stream::write;
+
+        u64 size() const;
+        u64 offset() const;
+        void seek(u64 distance, SeekMode mode);
+        void read(void* dest, size_t size);
+        void write(const void* data, size_t size);
+        void write(const Memory* segments, size_t count);
+
+        // write the buffered data and wait for the asynchronous writes; throws on failure
+        void flush();
+    };
+
+    /*
+        MappedFileStream writes into a memory mapped file which grows in large steps,
+        so the data goes straight into the page cache without an intermediate buffer.
+        acquire() exposes the mapping at the current offset for encoders which can
+        produce their output in place; commit() advances the stream past the bytes
+        which were written. The file is truncated to the written size when the stream
+        is closed. sync() flushes the written pages to the storage device.
+
+        NOTE: The file is grown sparsely; running out of disk space while writing
+              raises SIGBUS on Unix instead of an exception.
+
+        Usage example:
+
+        MappedFileStream file("texture.ktx");
+
+        Memory memory = file.acquire(header_size);
+        writeHeader(memory.address);
+        file.commit(header_size);
+
+        file.write(data, size);
+
+    */
+
+    class MappedFileStream : public Stream
+    {
+    protected:
+        struct MappedFileHandle* m_handle;
+
+    public:
+        MappedFileStream(const std::string& filename);
+        ~MappedFileStream();
+
+        const std::string& filename() const;
+
+        // writable memory of the requested size at the current offset
+        Memory acquire(size_t bytes);
+        void commit(size_t bytes);
+
+        void sync();
+
+        using Stream::write;
+
         u64 size() const;
         u64 offset() const;
         void seek(u64 distance, SeekMode mode);
         void read(void* dest, size_t size);
         void write(const void* data, size_t size);
+        void write(const Memory* segments, size_t count);
     };
 
+#ifdef MANGO_ENABLE_COROUTINE
+
+    // open and map a file in the ThreadPool; the awaiting coroutine is resumed
+    // with the mapped file without blocking a thread on the filesystem
+    inline AsyncTask<std::unique_ptr<File>> mapAsync(ThreadPool& pool, std::string filename)
+    {
+        co_await pool.schedule();
+        co_return std::make_unique<File>(filename);
+    }
+
+    inline AsyncTask<std::unique_ptr<File>> mapAsync(std::string filename)
+    {
+        return mapAsync(ThreadPool::getInstance(), std::move(filename));
+    }
+
+#endif
+
 } // namespace filesystem
 } // namespace mango
@@ -97,6 +97,10 @@ namespace filesystem {
         virtual bool isFile(const std::string& filename) const = 0;
         virtual void getIndex(FileIndex& index, const std::string& pathname) = 0;
         virtual VirtualMemory* mmap(const std::string& filename) = 0;
+
+        // map a range of the file; the default maps the whole file. The mappers which
+        // decompress the files override this to decode only the requested range.
+        virtual VirtualMemory* mmapRange(const std::string& filename, u64 offset, u64 size);
     };
 
     class Mapper : protected NonCopyable
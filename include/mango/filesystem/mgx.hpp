@@ -0,0 +1,54 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2019 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#pragma once
+
+#include <string>
+#include "../core/configure.hpp"
+#include "../core/compress.hpp"
+#include "../core/stream.hpp"
+
+namespace mango {
+namespace filesystem {
+
+    /*
+        MGXWriter creates .mgx containers. Small files are packed together into
+        shared blocks and the blocks are compressed in parallel on the ThreadPool.
+        A large file which does not compress is stored as a single uncompressed,
+        page aligned block, so that the reader can map it directly from the container.
+
+        The memory given to add() is referenced until finish() is called; files added
+        with addFile() and addTree() are mapped by the writer.
+
+        Usage example:
+
+        FileStream file("data.mgx", Stream::WRITE);
+        MGXWriter writer(file, getCompressor(Compressor::ZSTD));
+
+        writer.addTree("data/");
+        writer.add("config/settings.txt", settings);
+        writer.finish();
+
+    */
+
+    class MGXWriter : protected NonCopyable
+    {
+    protected:
+        struct WriterMGX* m_writer;
+
+    public:
+        MGXWriter(Stream& output, const Compressor& compressor, int level = 6);
+        ~MGXWriter();
+
+        void add(const std::string& filename, Memory memory);
+        void addFile(const std::string& filename, const std::string& source);
+        void addTree(const std::string& pathname, const std::string& prefix = "");
+
+        // compress the files, write the container and flush the output stream; called by
+        // the destructor if needed, but the errors are only reported when it is called explicitly
+        void finish();
+    };
+
+} // namespace filesystem
+} // namespace mango
@@ -5,6 +5,7 @@
 #pragma once
 
 #include "../core/object.hpp"
+#include "../core/trace.hpp"
 #include "../simd/simd.hpp"
 #include "surface.hpp"
 
@@ -69,6 +70,8 @@ namespace mango
 
         void convert(const BlitRect& rect) const
         {
+            MANGO_TRACE_SCOPE("image", "Blitter::convert");
+
             if (convertFunc)
                 convertFunc(*this, rect);
         }
@@ -12,6 +12,10 @@
 #include "../filesystem/file.hpp"
 #include "format.hpp"
 
+#ifdef MANGO_ENABLE_COROUTINE
+#include "../core/coroutine.hpp"
+#endif
+
 namespace mango
 {
 
@@ -53,8 +57,12 @@ namespace mango
 
     class Bitmap : private NonCopyable, public Surface
     {
+    protected:
+        Allocation m_allocation;
+
     public:
         Bitmap(int width, int height, const Format& format, int stride = 0, u8* image = nullptr);
+        Bitmap(int width, int height, const Format& format, Allocation allocation);
         Bitmap(Memory memory, const std::string& extension);
         Bitmap(Memory memory, const std::string& extension, const Format& format);
         Bitmap(const std::string& filename);
@@ -67,4 +75,45 @@ namespace mango
         Bitmap& operator = (Bitmap&& bitmap);
     };
 
+#ifdef MANGO_ENABLE_COROUTINE
+
+    /*
+        decodeAsync() decodes an image in the ThreadPool and resumes the awaiting
+        coroutine when the Bitmap is ready. The memory must remain valid until
+        the decoding has completed.
+
+        Usage example:
+
+        AsyncTask<void> load(std::string filename)
+        {
+            Bitmap bitmap = co_await decodeAsync(filename);
+            // TODO: use the bitmap..
+        }
+
+    */
+
+    inline AsyncTask<Bitmap> decodeAsync(ThreadPool& pool, Memory memory, std::string extension)
+    {
+        co_await pool.schedule();
+        co_return Bitmap(memory, extension);
+    }
+
+    inline AsyncTask<Bitmap> decodeAsync(ThreadPool& pool, std::string filename)
+    {
+        co_await pool.schedule();
+        co_return Bitmap(filename);
+    }
+
+    inline AsyncTask<Bitmap> decodeAsync(Memory memory, std::string extension)
+    {
+        return decodeAsync(ThreadPool::getInstance(), memory, std::move(extension));
+    }
+
+    inline AsyncTask<Bitmap> decodeAsync(std::string filename)
+    {
+        return decodeAsync(ThreadPool::getInstance(), std::move(filename));
+    }
+
+#endif
+
 } // namespace mango
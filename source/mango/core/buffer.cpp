@@ -13,6 +13,7 @@ namespace mango {
         : m_memory(nullptr, 0)
         , m_capacity(0)
         , m_offset(0)
+        , m_allocation(Allocation::DEFAULT)
     {
     }
 
@@ -20,6 +21,15 @@ namespace mango {
         : m_memory(new u8[bytes], bytes)
         , m_capacity(bytes)
         , m_offset(0)
+        , m_allocation(Allocation::DEFAULT)
+    {
+    }
+
+    Buffer::Buffer(size_t bytes, Allocation allocation)
+        : m_memory(allocate_storage(bytes, allocation), bytes)
+        , m_capacity(bytes)
+        , m_offset(0)
+        , m_allocation(allocation)
     {
     }
 
@@ -27,6 +37,7 @@ namespace mango {
         : m_memory(new u8[bytes], bytes)
         , m_capacity(bytes)
         , m_offset(0)
+        , m_allocation(Allocation::DEFAULT)
     {
         std::memcpy(m_memory.address, address, bytes);
     }
@@ -35,13 +46,44 @@ namespace mango {
         : m_memory(new u8[memory.size], memory.size)
         , m_capacity(memory.size)
         , m_offset(0)
+        , m_allocation(Allocation::DEFAULT)
     {
         std::memcpy(m_memory.address, memory.address, memory.size);
     }
 
+    Buffer::Buffer(Buffer&& buffer)
+        : m_memory(buffer.m_memory)
+        , m_capacity(buffer.m_capacity)
+        , m_offset(buffer.m_offset)
+        , m_allocation(buffer.m_allocation)
+    {
+        buffer.m_memory = Memory(nullptr, 0);
+        buffer.m_capacity = 0;
+        buffer.m_offset = 0;
+    }
+
     Buffer::~Buffer()
     {
-        delete[] m_memory.address;
+        free_storage(m_memory.address, m_allocation);
+    }
+
+    Buffer& Buffer::operator = (Buffer&& buffer)
+    {
+        if (this != &buffer)
+        {
+            free_storage(m_memory.address, m_allocation);
+
+            m_memory = buffer.m_memory;
+            m_capacity = buffer.m_capacity;
+            m_offset = buffer.m_offset;
+            m_allocation = buffer.m_allocation;
+
+            buffer.m_memory = Memory(nullptr, 0);
+            buffer.m_capacity = 0;
+            buffer.m_offset = 0;
+        }
+
+        return *this;
     }
 
     size_t Buffer::capacity() const
@@ -49,15 +91,20 @@ namespace mango {
         return m_capacity;        
     }
 
+    Allocation Buffer::allocation() const
+    {
+        return m_allocation;
+    }
+
     void Buffer::reserve(size_t bytes)
     {
         if (bytes > m_capacity)
         {
-            u8* storage = new u8[bytes];
+            u8* storage = allocate_storage(bytes, m_allocation);
             if (m_memory.address)
             {
                 std::memcpy(storage, m_memory.address, m_memory.size);
-                delete[] m_memory.address;
+                free_storage(m_memory.address, m_allocation);
             }
             m_memory.address = storage;
             m_capacity = bytes;
@@ -71,6 +118,33 @@ namespace mango {
         m_offset = std::min(m_offset, bytes);
     }
 
+    void Buffer::reset()
+    {
+        m_memory.size = 0;
+        m_offset = 0;
+    }
+
+    Memory Buffer::release()
+    {
+        Memory memory = m_memory;
+
+        m_memory = Memory(nullptr, 0);
+        m_capacity = 0;
+        m_offset = 0;
+
+        return memory;
+    }
+
+    void Buffer::adopt(Memory memory, size_t capacity, Allocation allocation)
+    {
+        free_storage(m_memory.address, m_allocation);
+
+        m_memory = memory;
+        m_capacity = std::max(capacity, memory.size);
+        m_offset = 0;
+        m_allocation = allocation;
+    }
+
     u8* Buffer::data() const
     {
         return m_memory.address;
@@ -131,8 +205,8 @@ namespace mango {
         size_t required = m_offset + bytes;
         if (required > m_capacity)
         {
-            // grow 1.4x the required capacity
-            reserve((required * 7) / 5);
+            // grow geometrically for amortized constant time writes
+            reserve(std::max(required, std::max(m_capacity * 2, size_t(256))));
         }
 
         std::memcpy(m_memory.address + m_offset, data, bytes);
@@ -140,4 +214,119 @@ namespace mango {
         m_memory.size = std::max(m_memory.size, m_offset);
     }
 
+    void Buffer::write(const Memory* segments, size_t count)
+    {
+        size_t bytes = 0;
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            bytes += segments[i].size;
+        }
+
+        size_t required = m_offset + bytes;
+        if (required > m_capacity)
+        {
+            reserve(std::max(required, std::max(m_capacity * 2, size_t(256))));
+        }
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            std::memcpy(m_memory.address + m_offset, segments[i].address, segments[i].size);
+            m_offset += segments[i].size;
+        }
+
+        m_memory.size = std::max(m_memory.size, m_offset);
+    }
+
+    // -----------------------------------------------------------------------
+    // BufferCache
+    // -----------------------------------------------------------------------
+
+    BufferCache::BufferCache(size_t maxCount, size_t maxCapacity)
+        : m_max_count(maxCount)
+        , m_max_capacity(maxCapacity)
+    {
+    }
+
+    BufferCache::~BufferCache()
+    {
+        clear();
+    }
+
+    Buffer BufferCache::acquire(size_t capacity, Allocation allocation)
+    {
+        Buffer buffer;
+        bool found = false;
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            // pick the smallest storage which is large enough
+            auto best = m_storage.end();
+
+            for (auto it = m_storage.begin(); it != m_storage.end(); ++it)
+            {
+                if (it->allocation == allocation && it->capacity >= capacity)
+                {
+                    if (best == m_storage.end() || it->capacity < best->capacity)
+                        best = it;
+                }
+            }
+
+            if (best != m_storage.end())
+            {
+                buffer.adopt(Memory(best->address, 0), best->capacity, best->allocation);
+                *best = m_storage.back();
+                m_storage.pop_back();
+                found = true;
+            }
+        }
+
+        if (!found)
+        {
+            u8* address = capacity ? allocate_storage(capacity, allocation) : nullptr;
+            buffer.adopt(Memory(address, 0), capacity, allocation);
+        }
+
+        return buffer;
+    }
+
+    void BufferCache::recycle(Buffer& buffer)
+    {
+        const size_t capacity = buffer.capacity();
+        const Allocation allocation = buffer.allocation();
+        Memory memory = buffer.release();
+
+        if (!memory.address)
+            return;
+
+        if (capacity <= m_max_capacity)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            if (m_storage.size() < m_max_count)
+            {
+                m_storage.push_back({ memory.address, capacity, allocation });
+                return;
+            }
+        }
+
+        free_storage(memory.address, allocation);
+    }
+
+    void BufferCache::clear()
+    {
+        std::vector<Storage> storage;
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            std::swap(storage, m_storage);
+        }
+
+        for (auto& node : storage)
+        {
+            free_storage(node.address, node.allocation);
+        }
+    }
+
 } // namespace mango
@@ -91,34 +91,8 @@ namespace miniz {
 
     void decompress(Memory dest, Memory source)
     {
-        mz_ulong dest_size = mz_ulong(dest.size);
-        mz_ulong source_size = mz_ulong(source.size);
-
-        int status = mz_uncompress(dest, &dest_size, source, source_size);
-        if (status != MZ_OK)
-        {
-            const char* msg = nullptr;
-            switch (status)
-            {
-                case MZ_MEM_ERROR:
-                    msg = "[miniz] not enough memory.";
-                    break;
-                case MZ_BUF_ERROR:
-                    msg = "[miniz] not enough room in the output buffer.";
-                    break;
-                case MZ_DATA_ERROR:
-                    msg = "[miniz] corrupted input data.";
-                    break;
-                default:
-                    msg = "[miniz] undefined error.";
-                    break;
-            }
-
-            if (msg)
-            {
-                MANGO_EXCEPTION(msg);
-            }
-        }
+        // the stream is compatible with the faster inflate engine
+        zlib::decompress(dest, source);
     }
 
 } // namespace miniz
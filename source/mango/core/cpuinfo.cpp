@@ -3,6 +3,11 @@
     Copyright (C) 2012-2019 Twilight Finland 3D Oy Ltd. All rights reserved.
 */
 #include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <thread>
 #include <mango/core/cpuinfo.hpp>
 
 namespace
@@ -211,6 +216,197 @@ namespace
         return 0; // unsupported platform
     }
 
+#endif
+
+    // ----------------------------------------------------------------------------
+    // getCPUTopologyInternal()
+    // ----------------------------------------------------------------------------
+
+    // dense index for each unique key in the order the keys are first seen
+    template <typename Key>
+    int getIndex(std::map<Key, int>& indices, const Key& key)
+    {
+        auto i = indices.find(key);
+        if (i != indices.end())
+            return i->second;
+
+        int index = int(indices.size());
+        indices[key] = index;
+        return index;
+    }
+
+    CPUTopology getGenericTopology()
+    {
+        CPUTopology topology;
+
+        const int count = std::max(int(std::thread::hardware_concurrency()), 1);
+
+        for (int i = 0; i < count; ++i)
+        {
+            CPUTopology::Processor processor;
+
+            processor.id = i;
+            processor.core = i;
+            processor.package = 0;
+            processor.cache = 0;
+            processor.node = 0;
+
+            topology.processors.push_back(processor);
+        }
+
+        topology.cores = count;
+        topology.packages = 1;
+        topology.caches = 1;
+        topology.nodes = 1;
+
+        return topology;
+    }
+
+#if defined(MANGO_PLATFORM_LINUX)
+
+    bool readText(const std::string& filename, std::string& text)
+    {
+        FILE* file = std::fopen(filename.c_str(), "r");
+        if (!file)
+            return false;
+
+        char buffer[1024];
+        size_t bytes = std::fread(buffer, 1, sizeof(buffer) - 1, file);
+        std::fclose(file);
+
+        buffer[bytes] = 0;
+        text = buffer;
+        return true;
+    }
+
+    int readInteger(const std::string& filename, int value)
+    {
+        std::string text;
+        if (readText(filename, text))
+        {
+            value = std::atoi(text.c_str());
+        }
+        return value;
+    }
+
+    // parse sysfs cpu list format, eg. "0-3,8,10-11"
+    std::vector<int> readList(const std::string& filename)
+    {
+        std::vector<int> list;
+
+        std::string text;
+        if (!readText(filename, text))
+            return list;
+
+        const char* p = text.c_str();
+
+        while (*p >= '0' && *p <= '9')
+        {
+            char* end;
+            int first = int(std::strtol(p, &end, 10));
+            int last = first;
+
+            if (*end == '-')
+            {
+                last = int(std::strtol(end + 1, &end, 10));
+            }
+
+            for (int i = first; i <= last; ++i)
+            {
+                list.push_back(i);
+            }
+
+            p = end;
+            if (*p == ',')
+                ++p;
+        }
+
+        return list;
+    }
+
+    CPUTopology getCPUTopologyInternal()
+    {
+        const std::string cpu_path = "/sys/devices/system/cpu/";
+        const std::string node_path = "/sys/devices/system/node/";
+
+        std::vector<int> online = readList(cpu_path + "online");
+        if (online.empty())
+            return getGenericTopology();
+
+        // NUMA node for each processor; machines without NUMA don't have the node directory
+        std::map<int, int> cpu_node;
+
+        for (int node : readList(node_path + "online"))
+        {
+            for (int cpu : readList(node_path + "node" + std::to_string(node) + "/cpulist"))
+            {
+                cpu_node[cpu] = node;
+            }
+        }
+
+        std::map<std::pair<int, int>, int> cores;
+        std::map<int, int> packages;
+        std::map<int, int> caches;
+        std::map<int, int> nodes;
+
+        CPUTopology topology;
+
+        for (int cpu : online)
+        {
+            const std::string path = cpu_path + "cpu" + std::to_string(cpu) + "/";
+
+            int package = readInteger(path + "topology/physical_package_id", 0);
+            int core = readInteger(path + "topology/core_id", cpu);
+
+            // the last level cache is identified by the first processor sharing it;
+            // processors without L3 are grouped by package (package ids are < 0 here)
+            int cache = -1 - package;
+
+            for (int index = 0; index < 8; ++index)
+            {
+                const std::string cache_path = path + "cache/index" + std::to_string(index) + "/";
+                if (readInteger(cache_path + "level", 0) == 3)
+                {
+                    std::vector<int> shared = readList(cache_path + "shared_cpu_list");
+                    if (!shared.empty())
+                    {
+                        cache = shared[0];
+                    }
+                    break;
+                }
+            }
+
+            auto i = cpu_node.find(cpu);
+            int node = i != cpu_node.end() ? i->second : 0;
+
+            CPUTopology::Processor processor;
+
+            processor.id = cpu;
+            processor.core = getIndex(cores, std::make_pair(package, core));
+            processor.package = getIndex(packages, package);
+            processor.cache = getIndex(caches, cache);
+            processor.node = getIndex(nodes, node);
+
+            topology.processors.push_back(processor);
+        }
+
+        topology.cores = int(cores.size());
+        topology.packages = int(packages.size());
+        topology.caches = int(caches.size());
+        topology.nodes = int(nodes.size());
+
+        return topology;
+    }
+
+#else
+
+    CPUTopology getCPUTopologyInternal()
+    {
+        // the topology is read only on Linux; elsewhere the processors are reported
+        // as separate cores sharing one cache and node (see cpuinfo.hpp)
+        return getGenericTopology();
+    }
+
 #endif
 
 } // namespace
@@ -224,4 +420,10 @@ namespace mango
         return flags;
     }
 
+    const CPUTopology& getCPUTopology()
+    {
+        static CPUTopology topology = getCPUTopologyInternal(); // cache the value
+        return topology;
+    }
+
 } // namespace mango
@@ -0,0 +1,922 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2019 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#include <cstring>
+#include <algorithm>
+#include <mango/core/compress.hpp>
+#include <mango/core/endian.hpp>
+#include <mango/core/exception.hpp>
+#include <mango/simd/simd.hpp>
+
+#define ID "[inflate] "
+
+/*
+    The decoder keeps a 64 bit bit-buffer which is refilled with one unaligned load
+    per decoded symbol; after a refill there are always enough bits for a complete
+    length + distance pair. The Huffman codes are decoded with one lookup of the next
+    LITLEN_TABLE_BITS bits and the longer codes continue in a subtable. A literal
+    entry can hold two literals when both codes fit into the lookup. The matches are
+    copied 16 bytes at a time when there is room for the overshoot.
+*/
+
+namespace
+{
+    using namespace mango;
+
+    // -----------------------------------------------------------------
+    // table entries
+    // -----------------------------------------------------------------
+
+    // [31..16] value, [12] two literals, [11..10] kind, [9..5] extra bits, [4..0] code bits
+    // The zero entry is an invalid code; ENTRY_INVALID marks the invalid symbols.
+
+    enum : u32
+    {
+        ENTRY_VALUE     = 0 << 10, // length, distance or code length symbol
+        ENTRY_LITERAL   = 1 << 10,
+        ENTRY_SUBTABLE  = 2 << 10,
+        ENTRY_END       = 3 << 10,
+        ENTRY_KIND_MASK = 3 << 10,
+        ENTRY_DOUBLE    = 1 << 12,
+        ENTRY_INVALID   = 0xffffffff,
+    };
+
+    constexpr u32 makeEntry(u32 value, u32 kind, u32 extra, u32 bits)
+    {
+        return (value << 16) | kind | (extra << 5) | bits;
+    }
+
+    inline u32 getEntryBits(u32 entry)
+    {
+        return entry & 31;
+    }
+
+    inline u32 getEntryExtra(u32 entry)
+    {
+        return (entry >> 5) & 31;
+    }
+
+    inline u32 getEntryValue(u32 entry)
+    {
+        return entry >> 16;
+    }
+
+    constexpr int MAX_CODE_BITS = 15;
+    constexpr int LITLEN_TABLE_BITS = 11;
+    constexpr int DISTANCE_TABLE_BITS = 8;
+    constexpr int PRECODE_TABLE_BITS = 7;
+
+    // every long code can start at most one subtable
+    constexpr int LITLEN_TABLE_SIZE = (1 << LITLEN_TABLE_BITS) + 288 * (1 << (MAX_CODE_BITS - LITLEN_TABLE_BITS));
+    constexpr int DISTANCE_TABLE_SIZE = (1 << DISTANCE_TABLE_BITS) + 32 * (1 << (MAX_CODE_BITS - DISTANCE_TABLE_BITS));
+
+    const u16 g_length_base[] =
+    {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+    };
+
+    const u8 g_length_extra[] =
+    {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+        3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+    };
+
+    const u16 g_distance_base[] =
+    {
+        1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+        257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+    };
+
+    const u8 g_distance_extra[] =
+    {
+        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+        7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+    };
+
+    u32 getLitlenEntry(int symbol)
+    {
+        if (symbol < 256)
+            return makeEntry(symbol, ENTRY_LITERAL, 0, 0);
+        if (symbol == 256)
+            return makeEntry(0, ENTRY_END, 0, 0);
+        if (symbol < 286)
+            return makeEntry(g_length_base[symbol - 257], ENTRY_VALUE, g_length_extra[symbol - 257], 0);
+        return ENTRY_INVALID;
+    }
+
+    u32 getDistanceEntry(int symbol)
+    {
+        if (symbol < 30)
+            return makeEntry(g_distance_base[symbol], ENTRY_VALUE, g_distance_extra[symbol], 0);
+        return ENTRY_INVALID;
+    }
+
+    u32 getPrecodeEntry(int symbol)
+    {
+        return makeEntry(symbol, ENTRY_VALUE, 0, 0);
+    }
+
+    // -----------------------------------------------------------------
+    // buildTable()
+    // -----------------------------------------------------------------
+
+    // Builds the decoding table from the code lengths; returns false if the
+    // lengths are over-subscribed. Incomplete codes leave invalid (zero) entries.
+
+    template <typename SymbolEntry>
+    bool buildTable(u32* table, const u8* lengths, int num, int table_bits, SymbolEntry symbolEntry)
+    {
+        u16 count[MAX_CODE_BITS + 1] = { 0 };
+
+        for (int i = 0; i < num; ++i)
+        {
+            count[lengths[i]]++;
+        }
+
+        count[0] = 0;
+
+        int left = 1;
+        for (int len = 1; len <= MAX_CODE_BITS; ++len)
+        {
+            left = (left << 1) - count[len];
+            if (left < 0)
+                return false;
+        }
+
+        // sort the symbols by code length
+        u16 offset[MAX_CODE_BITS + 2];
+        offset[1] = 0;
+
+        for (int len = 1; len <= MAX_CODE_BITS; ++len)
+        {
+            offset[len + 1] = offset[len] + count[len];
+        }
+
+        u16 sorted[288];
+
+        for (int i = 0; i < num; ++i)
+        {
+            if (lengths[i])
+            {
+                sorted[offset[lengths[i]]++] = u16(i);
+            }
+        }
+
+        const u32 table_size = 1u << table_bits;
+        std::memset(table, 0, table_size * sizeof(u32));
+
+        u16 remain[MAX_CODE_BITS + 1];
+        std::memcpy(remain, count, sizeof(count));
+
+        u32 next = table_size; // next free subtable
+        u32 sub_prefix = ~0u;
+        u32 sub_start = 0;
+        u32 sub_bits = 0;
+
+        u32 code = 0;
+        int index = 0;
+
+        for (int len = 1; len <= MAX_CODE_BITS; ++len)
+        {
+            for (int k = 0; k < count[len]; ++k)
+            {
+                const u32 entry = symbolEntry(sorted[index++]);
+
+                // the codes are stored starting from the most significant bit
+                u32 reversed = 0;
+                for (int i = 0; i < len; ++i)
+                {
+                    reversed |= ((code >> i) & 1) << (len - 1 - i);
+                }
+
+                if (len <= table_bits)
+                {
+                    for (u32 i = reversed; i < table_size; i += 1u << len)
+                    {
+                        table[i] = entry != ENTRY_INVALID ? entry | len : 0;
+                    }
+                }
+                else
+                {
+                    const u32 prefix = reversed & (table_size - 1);
+                    if (prefix != sub_prefix)
+                    {
+                        // the subtable has to fit the remaining codes with this prefix
+                        u32 bits = len - table_bits;
+                        int space = 1 << bits;
+
+                        while (bits + table_bits < MAX_CODE_BITS)
+                        {
+                            space -= remain[bits + table_bits];
+                            if (space <= 0)
+                                break;
+                            ++bits;
+                            space <<= 1;
+                        }
+
+                        sub_prefix = prefix;
+                        sub_start = next;
+                        sub_bits = bits;
+                        next += 1u << bits;
+
+                        std::memset(table + sub_start, 0, (1u << bits) * sizeof(u32));
+                        table[prefix] = makeEntry(sub_start, ENTRY_SUBTABLE, bits, table_bits);
+                    }
+
+                    const u32 sub_len = len - table_bits;
+                    for (u32 i = reversed >> table_bits; i < (1u << sub_bits); i += 1u << sub_len)
+                    {
+                        table[sub_start + i] = entry != ENTRY_INVALID ? entry | sub_len : 0;
+                    }
+                }
+
+                --remain[len];
+                ++code;
+            }
+
+            code <<= 1;
+        }
+
+        return true;
+    }
+
+    // Combine two literals into one entry when the second code is inside the
+    // lookup bits. The table is processed backwards so that the second lookup
+    // always reads an entry which has not been combined yet.
+
+    void combineLiterals(u32* table, int table_bits)
+    {
+        for (int i = (1 << table_bits) - 1; i >= 0; --i)
+        {
+            const u32 entry = table[i];
+            if ((entry & ENTRY_KIND_MASK) != ENTRY_LITERAL)
+                continue;
+
+            const u32 bits = getEntryBits(entry);
+            const u32 second = table[u32(i) >> bits];
+
+            if ((second & ENTRY_KIND_MASK) == ENTRY_LITERAL && getEntryBits(second) <= table_bits - bits)
+            {
+                const u32 value = getEntryValue(entry) | (getEntryValue(second) << 8);
+                table[i] = makeEntry(value, ENTRY_LITERAL | ENTRY_DOUBLE, 0, bits + getEntryBits(second));
+            }
+        }
+    }
+
+    struct FixedTables
+    {
+        u32 litlen[LITLEN_TABLE_SIZE];
+        u32 distance[DISTANCE_TABLE_SIZE];
+
+        FixedTables()
+        {
+            u8 lengths[288];
+            std::memset(lengths +   0, 8, 144);
+            std::memset(lengths + 144, 9, 112);
+            std::memset(lengths + 256, 7, 24);
+            std::memset(lengths + 280, 8, 8);
+            buildTable(litlen, lengths, 288, LITLEN_TABLE_BITS, getLitlenEntry);
+            combineLiterals(litlen, LITLEN_TABLE_BITS);
+
+            std::memset(lengths, 5, 32);
+            buildTable(distance, lengths, 32, DISTANCE_TABLE_BITS, getDistanceEntry);
+        }
+    };
+
+    // -----------------------------------------------------------------
+    // copyMatch()
+    // -----------------------------------------------------------------
+
+    // The copy can write up to 15 bytes past the match; the caller checks there is room.
+
+    inline void copyMatch(u8* dest, const u8* src, u32 length, u32 distance)
+    {
+        u8* end = dest + length;
+
+        if (distance >= 16)
+        {
+            do
+            {
+                simd::u32x4 v = simd::u32x4_uload(reinterpret_cast<const u32*>(src));
+                simd::u32x4_ustore(reinterpret_cast<u32*>(dest), v);
+                src += 16;
+                dest += 16;
+            } while (dest < end);
+        }
+        else if (distance == 1)
+        {
+            simd::u32x4 v = simd::u32x4_set1(src[0] * 0x01010101u);
+            do
+            {
+                simd::u32x4_ustore(reinterpret_cast<u32*>(dest), v);
+                dest += 16;
+            } while (dest < end);
+        }
+        else if (distance >= 8)
+        {
+            do
+            {
+                ustore64(dest, uload64(src));
+                src += 8;
+                dest += 8;
+            } while (dest < end);
+        }
+        else
+        {
+            do
+            {
+                *dest++ = *src++;
+            } while (dest < end);
+        }
+    }
+
+    // -----------------------------------------------------------------
+    // Inflater
+    // -----------------------------------------------------------------
+
+    // thrown by a truncating Inflater when the output is full
+    struct OutputFull
+    {
+    };
+
+    class Inflater
+    {
+    protected:
+        const u8* m_start;
+        const u8* m_input;
+        const u8* m_input_end;
+        size_t m_overrun;
+        bool m_truncate; // stop when the output is full instead of failing
+        bool m_complete;
+
+        u64 m_bitbuf;
+        u32 m_bitcount;
+
+        u32 m_litlen[LITLEN_TABLE_SIZE];
+        u32 m_distance[DISTANCE_TABLE_SIZE];
+
+        void refill()
+        {
+            if (m_input_end - m_input >= 8)
+            {
+                // the bits above the count are the same bits which the next refill loads
+                m_bitbuf |= uload64le(m_input) << m_bitcount;
+                m_input += (63 - m_bitcount) >> 3;
+                m_bitcount |= 56;
+            }
+            else
+            {
+                while (m_bitcount < 56)
+                {
+                    if (m_input < m_input_end)
+                    {
+                        m_bitbuf |= u64(*m_input++) << m_bitcount;
+                    }
+                    else if (++m_overrun > 16)
+                    {
+                        MANGO_EXCEPTION(ID"Unexpected end of input.");
+                    }
+                    m_bitcount += 8;
+                }
+            }
+        }
+
+        // the output is full; a truncating inflater keeps what has been written
+        void overflow() const
+        {
+            if (m_truncate)
+            {
+                throw OutputFull();
+            }
+
+            MANGO_EXCEPTION(ID"Not enough room in the output buffer.");
+        }
+
+        u32 getBits(u32 count)
+        {
+            if (m_bitcount < count)
+            {
+                refill();
+            }
+
+            u32 value = u32(m_bitbuf & ((1ull << count) - 1));
+            m_bitbuf >>= count;
+            m_bitcount -= count;
+            return value;
+        }
+
+        // byte position of the next unconsumed bit
+        const u8* getBytePosition() const
+        {
+            const size_t buffered = m_bitcount >> 3;
+            if (buffered < m_overrun)
+            {
+                MANGO_EXCEPTION(ID"Unexpected end of input.");
+            }
+            return m_input - (buffered - m_overrun);
+        }
+
+        void decodeStored(u8*& out, u8* out_end)
+        {
+            // discard the bits up to the byte boundary and restart from the byte position
+            getBits(m_bitcount & 7);
+            m_input = getBytePosition();
+            m_overrun = 0;
+            m_bitbuf = 0;
+            m_bitcount = 0;
+
+            if (m_input_end - m_input < 4)
+            {
+                MANGO_EXCEPTION(ID"Unexpected end of input.");
+            }
+
+            const u32 length = uload16le(m_input + 0);
+            const u32 nlength = uload16le(m_input + 2);
+            m_input += 4;
+
+            if (length != (~nlength & 0xffff))
+            {
+                MANGO_EXCEPTION(ID"Corrupted stored block.");
+            }
+
+            if (size_t(m_input_end - m_input) < length)
+            {
+                MANGO_EXCEPTION(ID"Unexpected end of input.");
+            }
+
+            if (size_t(out_end - out) < length)
+            {
+                std::memcpy(out, m_input, out_end - out);
+                overflow();
+            }
+
+            if (length)
+            {
+                std::memcpy(out, m_input, length);
+            }
+
+            m_input += length;
+            out += length;
+        }
+
+        void readDynamicTables()
+        {
+            static const u8 order[] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+            const int hlit = getBits(5) + 257;
+            const int hdist = getBits(5) + 1;
+            const int hclen = getBits(4) + 4;
+
+            if (hlit > 286 || hdist > 30)
+            {
+                MANGO_EXCEPTION(ID"Incorrect code counts.");
+            }
+
+            u8 precode_lengths[19] = { 0 };
+
+            for (int i = 0; i < hclen; ++i)
+            {
+                precode_lengths[order[i]] = u8(getBits(3));
+            }
+
+            u32 precode[1 << PRECODE_TABLE_BITS];
+            if (!buildTable(precode, precode_lengths, 19, PRECODE_TABLE_BITS, getPrecodeEntry))
+            {
+                MANGO_EXCEPTION(ID"Incorrect code lengths.");
+            }
+
+            u8 lengths[286 + 30];
+            const int total = hlit + hdist;
+
+            for (int n = 0; n < total; )
+            {
+                if (m_bitcount < 16)
+                {
+                    refill();
+                }
+
+                const u32 entry = precode[m_bitbuf & ((1u << PRECODE_TABLE_BITS) - 1)];
+                const u32 bits = getEntryBits(entry);
+                if (!bits)
+                {
+                    MANGO_EXCEPTION(ID"Incorrect code lengths.");
+                }
+
+                m_bitbuf >>= bits;
+                m_bitcount -= bits;
+
+                const u32 symbol = getEntryValue(entry);
+                if (symbol < 16)
+                {
+                    lengths[n++] = u8(symbol);
+                    continue;
+                }
+
+                u8 value = 0;
+                int count;
+
+                if (symbol == 16)
+                {
+                    if (!n)
+                    {
+                        MANGO_EXCEPTION(ID"Incorrect code lengths.");
+                    }
+                    value = lengths[n - 1];
+                    count = 3 + getBits(2);
+                }
+                else if (symbol == 17)
+                {
+                    count = 3 + getBits(3);
+                }
+                else
+                {
+                    count = 11 + getBits(7);
+                }
+
+                if (n + count > total)
+                {
+                    MANGO_EXCEPTION(ID"Incorrect code lengths.");
+                }
+
+                std::memset(lengths + n, value, count);
+                n += count;
+            }
+
+            if (!lengths[256])
+            {
+                MANGO_EXCEPTION(ID"Missing end-of-block code.");
+            }
+
+            if (!buildTable(m_litlen, lengths, hlit, LITLEN_TABLE_BITS, getLitlenEntry) ||
+                !buildTable(m_distance, lengths + hlit, hdist, DISTANCE_TABLE_BITS, getDistanceEntry))
+            {
+                MANGO_EXCEPTION(ID"Incorrect code lengths.");
+            }
+
+            combineLiterals(m_litlen, LITLEN_TABLE_BITS);
+        }
+
+        void decodeHuffman(u8*& output, u8* out_start, u8* out_end, const u32* litlen, const u32* distance)
+        {
+            constexpr u32 litlen_mask = (1u << LITLEN_TABLE_BITS) - 1;
+            constexpr u32 distance_mask = (1u << DISTANCE_TABLE_BITS) - 1;
+
+            // the state lives in registers; the output writes could alias the members
+            const u8* input = m_input;
+            const u8* input_end = m_input_end;
+            u64 bitbuf = m_bitbuf;
+            u32 bitcount = m_bitcount;
+            u8* out = output;
+
+            for (;;)
+            {
+                if (input_end - input >= 8)
+                {
+                    bitbuf |= uload64le(input) << bitcount;
+                    input += (63 - bitcount) >> 3;
+                    bitcount |= 56;
+                }
+                else
+                {
+                    m_input = input;
+                    m_bitbuf = bitbuf;
+                    m_bitcount = bitcount;
+                    refill();
+                    input = m_input;
+                    bitbuf = m_bitbuf;
+                    bitcount = m_bitcount;
+                }
+
+                u32 entry = litlen[bitbuf & litlen_mask];
+                u32 kind = entry & ENTRY_KIND_MASK;
+
+                if (kind == ENTRY_LITERAL)
+                {
+                    const u32 bits = getEntryBits(entry);
+                    bitbuf >>= bits;
+                    bitcount -= bits;
+
+                    if (entry & ENTRY_DOUBLE)
+                    {
+                        if (out_end - out < 2)
+                        {
+                            if (out < out_end)
+                            {
+                                *out++ = u8(entry >> 16);
+                            }
+                            overflow();
+                        }
+                        ustore16le(out, u16(entry >> 16));
+                        out += 2;
+                    }
+                    else
+                    {
+                        if (out == out_end)
+                        {
+                            overflow();
+                        }
+                        *out++ = u8(entry >> 16);
+                    }
+
+                    continue;
+                }
+
+                if (kind == ENTRY_SUBTABLE)
+                {
+                    bitbuf >>= LITLEN_TABLE_BITS;
+                    bitcount -= LITLEN_TABLE_BITS;
+                    entry = litlen[getEntryValue(entry) + (bitbuf & ((1u << getEntryExtra(entry)) - 1))];
+                    kind = entry & ENTRY_KIND_MASK;
+
+                    if (kind == ENTRY_LITERAL)
+                    {
+                        const u32 bits = getEntryBits(entry);
+                        bitbuf >>= bits;
+                        bitcount -= bits;
+
+                        if (out == out_end)
+                        {
+                            overflow();
+                        }
+                        *out++ = u8(entry >> 16);
+                        continue;
+                    }
+                }
+
+                if (kind == ENTRY_END)
+                {
+                    const u32 bits = getEntryBits(entry);
+                    bitbuf >>= bits;
+                    bitcount -= bits;
+                    break;
+                }
+
+                if (!entry)
+                {
+                    MANGO_EXCEPTION(ID"Incorrect literal/length code.");
+                }
+
+                // length
+                u32 bits = getEntryBits(entry);
+                u32 extra = getEntryExtra(entry);
+                bitbuf >>= bits;
+                const u32 length = getEntryValue(entry) + u32(bitbuf & ((1u << extra) - 1));
+                bitbuf >>= extra;
+                bitcount -= bits + extra;
+
+                // distance
+                entry = distance[bitbuf & distance_mask];
+                if ((entry & ENTRY_KIND_MASK) == ENTRY_SUBTABLE)
+                {
+                    bitbuf >>= DISTANCE_TABLE_BITS;
+                    bitcount -= DISTANCE_TABLE_BITS;
+                    entry = distance[getEntryValue(entry) + (bitbuf & ((1u << getEntryExtra(entry)) - 1))];
+                }
+
+                if (!entry)
+                {
+                    MANGO_EXCEPTION(ID"Incorrect distance code.");
+                }
+
+                bits = getEntryBits(entry);
+                extra = getEntryExtra(entry);
+                bitbuf >>= bits;
+                const u32 dist = getEntryValue(entry) + u32(bitbuf & ((1u << extra) - 1));
+                bitbuf >>= extra;
+                bitcount -= bits + extra;
+
+                if (dist > size_t(out - out_start))
+                {
+                    MANGO_EXCEPTION(ID"Incorrect match distance.");
+                }
+
+                const size_t room = out_end - out;
+                const u8* src = out - dist;
+
+                if (length > room)
+                {
+                    for (size_t i = 0; i < room; ++i)
+                    {
+                        *out++ = *src++;
+                    }
+                    overflow();
+                }
+
+                if (room >= length + 15)
+                {
+                    copyMatch(out, src, length, dist);
+                    out += length;
+                }
+                else
+                {
+                    for (u32 i = 0; i < length; ++i)
+                    {
+                        *out++ = *src++;
+                    }
+                }
+            }
+
+            m_input = input;
+            m_bitbuf = bitbuf;
+            m_bitcount = bitcount;
+            output = out;
+        }
+
+    public:
+        Inflater(Memory source, bool truncate = false)
+            : m_start(source.address)
+            , m_input(source.address)
+            , m_input_end(source.address + source.size)
+            , m_overrun(0)
+            , m_truncate(truncate)
+            , m_complete(true)
+            , m_bitbuf(0)
+            , m_bitcount(0)
+        {
+        }
+
+        // returns the number of bytes written
+        size_t decode(Memory dest)
+        {
+            static const FixedTables fixed;
+
+            u8* out = dest.address;
+            u8* out_end = dest.address + dest.size;
+
+            try
+            {
+                for (bool final = false; !final; )
+                {
+                    final = getBits(1) != 0;
+                    const u32 type = getBits(2);
+
+                    switch (type)
+                    {
+                        case 0:
+                            decodeStored(out, out_end);
+                            break;
+
+                        case 1:
+                            decodeHuffman(out, dest.address, out_end, fixed.litlen, fixed.distance);
+                            break;
+
+                        case 2:
+                            readDynamicTables();
+                            decodeHuffman(out, dest.address, out_end, m_litlen, m_distance);
+                            break;
+
+                        default:
+                            MANGO_EXCEPTION(ID"Incorrect block type.");
+                    }
+                }
+            }
+            catch (const OutputFull&)
+            {
+                // the rest of the stream is discarded
+                m_complete = false;
+                return dest.size;
+            }
+
+            return out - dest.address;
+        }
+
+        // the whole stream was decoded; a truncated stream has no position for the checksum
+        bool complete() const
+        {
+            return m_complete;
+        }
+
+        // bytes consumed from the source
+        size_t consumed() const
+        {
+            return getBytePosition() - m_start;
+        }
+    };
+
+    u32 adler32(u32 adler, const u8* data, size_t size)
+    {
+        u32 a = adler & 0xffff;
+        u32 b = adler >> 16;
+
+        while (size > 0)
+        {
+            // largest block which cannot overflow b before the modulo
+            size_t block = std::min(size, size_t(5552));
+            size -= block;
+
+            for ( ; block >= 8; block -= 8)
+            {
+                a += data[0]; b += a;
+                a += data[1]; b += a;
+                a += data[2]; b += a;
+                a += data[3]; b += a;
+                a += data[4]; b += a;
+                a += data[5]; b += a;
+                a += data[6]; b += a;
+                a += data[7]; b += a;
+                data += 8;
+            }
+
+            for ( ; block > 0; --block)
+            {
+                a += *data++;
+                b += a;
+            }
+
+            a %= 65521;
+            b %= 65521;
+        }
+
+        return (b << 16) | a;
+    }
+
+} // namespace
+
+namespace mango
+{
+
+    // -----------------------------------------------------------------
+    // deflate
+    // -----------------------------------------------------------------
+
+    namespace deflate
+    {
+
+        size_t decompress(Memory dest, Memory source)
+        {
+            Inflater inflater(source);
+            return inflater.decode(dest);
+        }
+
+    } // namespace deflate
+
+    // -----------------------------------------------------------------
+    // zlib
+    // -----------------------------------------------------------------
+
+    namespace zlib
+    {
+
+        static void checkHeader(Memory source)
+        {
+            if (source.size < 6)
+            {
+                MANGO_EXCEPTION(ID"Unexpected end of input.");
+            }
+
+            const u32 cmf = source.address[0];
+            const u32 flg = source.address[1];
+
+            if ((cmf & 0x0f) != 8 || (cmf >> 4) > 7 || ((cmf << 8) | flg) % 31 || (flg & 0x20))
+            {
+                MANGO_EXCEPTION(ID"Incorrect zlib header.");
+            }
+        }
+
+        size_t decompress(Memory dest, Memory source)
+        {
+            checkHeader(source);
+
+            Inflater inflater(Memory(source.address + 2, source.size - 2));
+            size_t written = inflater.decode(dest);
+
+            const size_t offset = 2 + inflater.consumed();
+            if (offset + 4 > source.size)
+            {
+                MANGO_EXCEPTION(ID"Missing checksum.");
+            }
+
+            if (adler32(1, dest.address, written) != uload32be(source.address + offset))
+            {
+                MANGO_EXCEPTION(ID"Checksum mismatch.");
+            }
+
+            return written;
+        }
+
+        size_t decompress(Memory dest, Memory source, bool& checksum)
+        {
+            checkHeader(source);
+
+            Inflater inflater(Memory(source.address + 2, source.size - 2), true);
+            size_t written = inflater.decode(dest);
+
+            checksum = false;
+
+            if (inflater.complete())
+            {
+                const size_t offset = 2 + inflater.consumed();
+                if (offset + 4 <= source.size)
+                {
+                    checksum = adler32(1, dest.address, written) == uload32be(source.address + offset);
+                }
+            }
+
+            return written;
+        }
+
+    } // namespace zlib
+
+} // namespace mango
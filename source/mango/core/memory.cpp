@@ -3,8 +3,17 @@
     Copyright (C) 2012-2019 Twilight Finland 3D Oy Ltd. All rights reserved.
 */
 #include <cassert>
+#include <map>
+#include <unordered_map>
+#include <vector>
 #include <mango/core/bits.hpp>
 #include <mango/core/memory.hpp>
+#include <mango/core/thread.hpp>
+
+#if defined(MANGO_PLATFORM_UNIX)
+    #include <unistd.h>
+    #include <sys/mman.h>
+#endif
 
 namespace mango {
 
@@ -128,3 +137,518 @@ namespace mango {
 #endif
 
 } // namespace mango
+
+namespace
+{
+    using namespace mango;
+
+    // -----------------------------------------------------------------------
+    // virtual memory
+    // -----------------------------------------------------------------------
+
+    constexpr size_t g_huge_page_size = 2 * 1024 * 1024;
+
+    size_t getPageSize()
+    {
+#if defined(MANGO_PLATFORM_UNIX)
+        static const size_t size = size_t(::sysconf(_SC_PAGESIZE));
+#elif defined(MANGO_PLATFORM_WINDOWS)
+        static const size_t size = [] {
+            SYSTEM_INFO info;
+            ::GetSystemInfo(&info);
+            return size_t(info.dwPageSize);
+        } ();
+#else
+        static const size_t size = 4096;
+#endif
+        return size;
+    }
+
+#if defined(MANGO_PLATFORM_UNIX)
+
+    void* map_pages(size_t size, Allocation allocation)
+    {
+#if defined(MAP_HUGETLB)
+        if (allocation & Allocation::EXPLICIT_HUGE_PAGES)
+        {
+            // fails when the huge page pool is not configured
+            void* address = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (address != MAP_FAILED)
+                return address;
+        }
+#endif
+
+        const bool huge = allocation & Allocation::HUGE_PAGES;
+
+        // transparent huge pages are only used for aligned 2 MB ranges
+        const size_t padding = huge ? g_huge_page_size : 0;
+
+        void* memory = ::mmap(nullptr, size + padding, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+            return nullptr;
+
+        u8* address = reinterpret_cast<u8*>(memory);
+
+        if (padding)
+        {
+            u8* aligned = reinterpret_cast<u8*>((uintptr_t(address) + padding - 1) & ~uintptr_t(padding - 1));
+            size_t head = aligned - address;
+            size_t tail = padding - head;
+
+            if (head)
+                ::munmap(address, head);
+            if (tail)
+                ::munmap(aligned + size, tail);
+
+            address = aligned;
+
+#if defined(MADV_HUGEPAGE)
+            ::madvise(address, size, MADV_HUGEPAGE);
+#endif
+        }
+
+        return address;
+    }
+
+    void unmap_pages(void* address, size_t size)
+    {
+        ::munmap(address, size);
+    }
+
+#elif defined(MANGO_PLATFORM_WINDOWS)
+
+    void* map_pages(size_t size, Allocation allocation)
+    {
+        if (allocation & Allocation::EXPLICIT_HUGE_PAGES)
+        {
+            // requires the SeLockMemoryPrivilege; the size is a multiple of the huge page size
+            const size_t minimum = ::GetLargePageMinimum();
+            if (minimum && !(size % minimum))
+            {
+                void* address = ::VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+                if (address)
+                    return address;
+            }
+        }
+
+        return ::VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    }
+
+    void unmap_pages(void* address, size_t size)
+    {
+        MANGO_UNREFERENCED_PARAMETER(size);
+        ::VirtualFree(address, 0, MEM_RELEASE);
+    }
+
+#else
+
+    void* map_pages(size_t size, Allocation allocation)
+    {
+        MANGO_UNREFERENCED_PARAMETER(allocation);
+        return aligned_malloc(size, getPageSize());
+    }
+
+    void unmap_pages(void* address, size_t size)
+    {
+        MANGO_UNREFERENCED_PARAMETER(size);
+        aligned_free(address);
+    }
+
+#endif
+
+    void prefault_pages(u8* address, size_t size)
+    {
+        const size_t page = getPageSize();
+
+        auto touch = [=] (size_t begin, size_t end)
+        {
+            for (size_t offset = begin; offset < end; offset += page)
+            {
+                // the contents are undefined so any write will do
+                reinterpret_cast<volatile u8*>(address)[offset] = 0;
+            }
+        };
+
+        const size_t slice = 4 * g_huge_page_size;
+
+        if (size <= slice)
+        {
+            touch(0, size);
+            return;
+        }
+
+        ConcurrentQueue queue("memory.prefault", Priority::HIGH);
+
+        for (size_t offset = 0; offset < size; offset += slice)
+        {
+            const size_t end = std::min(offset + slice, size);
+            queue.enqueue([=] {
+                touch(offset, end);
+            });
+        }
+
+        queue.wait();
+    }
+
+    // -----------------------------------------------------------------------
+    // LargeMemory
+    // -----------------------------------------------------------------------
+
+    struct LargeBlock
+    {
+        size_t size;
+        Allocation pages; // the flags which affect the mapping
+    };
+
+    struct LargeMemory
+    {
+        std::mutex mutex;
+        std::unordered_map<void*, LargeBlock> blocks; // allocated blocks
+        std::multimap<size_t, std::pair<void*, LargeBlock>> cache; // freed blocks by size
+        size_t cache_size = 0;
+        size_t cache_limit = 256 * 1024 * 1024;
+
+        // size classes: eight steps between powers of two, rounded to the page size
+        static size_t getClassSize(size_t size, Allocation pages)
+        {
+            const size_t granularity = (pages & Allocation::HUGE_PAGES) ? g_huge_page_size : getPageSize();
+            size_t step = size_t(1) << u64_log2(u64(size));
+            step = std::max(step / 8, granularity);
+            return (size + step - 1) & ~(step - 1);
+        }
+
+        // remove blocks from the cache until it is within the limit; the caller unmaps them
+        void evict(std::vector<std::pair<void*, LargeBlock>>& evicted)
+        {
+            while (cache_size > cache_limit)
+            {
+                // evict the largest block first; it has the least chance of being reused
+                auto it = std::prev(cache.end());
+                cache_size -= it->first;
+                evicted.push_back(it->second);
+                cache.erase(it);
+            }
+        }
+    };
+
+    LargeMemory& getLargeMemory()
+    {
+        // NOTE: intentionally leaked; static Bitmaps can be destroyed after us
+        static LargeMemory* memory = new LargeMemory();
+        return *memory;
+    }
+
+    Allocation getPageFlags(Allocation allocation)
+    {
+        return Allocation(u32(allocation) & u32(Allocation::EXPLICIT_HUGE_PAGES));
+    }
+
+} // namespace
+
+namespace mango
+{
+
+    // -----------------------------------------------------------------------
+    // large memory allocation
+    // -----------------------------------------------------------------------
+
+    void* large_malloc(size_t size, Allocation allocation)
+    {
+        if (!size)
+            return nullptr;
+
+        const Allocation pages = getPageFlags(allocation);
+        const size_t class_size = LargeMemory::getClassSize(size, pages);
+
+        LargeMemory& memory = getLargeMemory();
+
+        u8* reused = nullptr;
+        size_t reused_size = 0;
+
+        {
+            std::lock_guard<std::mutex> lock(memory.mutex);
+
+            // accept blocks up to a quarter larger than the size class
+            auto first = memory.cache.lower_bound(class_size);
+            auto last = memory.cache.upper_bound(class_size + class_size / 4);
+
+            for (auto it = first; it != last; ++it)
+            {
+                if (it->second.second.pages == pages)
+                {
+                    reused = reinterpret_cast<u8*>(it->second.first);
+                    reused_size = it->first;
+                    memory.blocks[reused] = it->second.second;
+                    memory.cache_size -= it->first;
+                    memory.cache.erase(it);
+                    break;
+                }
+            }
+        }
+
+        if (reused)
+        {
+            // the previous owner did not necessarily touch every page
+            if (allocation & Allocation::PREFAULT)
+            {
+                prefault_pages(reused, reused_size);
+            }
+
+            return reused;
+        }
+
+        u8* address = reinterpret_cast<u8*>(map_pages(class_size, pages));
+        if (!address)
+        {
+            throw std::bad_alloc();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(memory.mutex);
+            memory.blocks[address] = LargeBlock { class_size, pages };
+        }
+
+        if (allocation & Allocation::PREFAULT)
+        {
+            prefault_pages(address, class_size);
+        }
+
+        return address;
+    }
+
+    void large_free(void* address)
+    {
+        if (!address)
+            return;
+
+        LargeMemory& memory = getLargeMemory();
+        std::vector<std::pair<void*, LargeBlock>> evicted;
+
+        {
+            std::lock_guard<std::mutex> lock(memory.mutex);
+
+            auto it = memory.blocks.find(address);
+            if (it == memory.blocks.end())
+            {
+                assert(!"large_free(): unknown address");
+                return;
+            }
+
+            LargeBlock block = it->second;
+            memory.blocks.erase(it);
+
+            memory.cache.emplace(block.size, std::make_pair(address, block));
+            memory.cache_size += block.size;
+            memory.evict(evicted);
+        }
+
+        for (auto& node : evicted)
+        {
+            unmap_pages(node.first, node.second.size);
+        }
+    }
+
+    void setLargeMemoryCacheSize(size_t bytes)
+    {
+        LargeMemory& memory = getLargeMemory();
+        std::vector<std::pair<void*, LargeBlock>> evicted;
+
+        {
+            std::lock_guard<std::mutex> lock(memory.mutex);
+            memory.cache_limit = bytes;
+            memory.evict(evicted);
+        }
+
+        for (auto& node : evicted)
+        {
+            unmap_pages(node.first, node.second.size);
+        }
+    }
+
+    u8* allocate_storage(size_t size, Allocation allocation)
+    {
+        if (allocation == Allocation::DEFAULT)
+        {
+            return new u8[size];
+        }
+
+        return reinterpret_cast<u8*>(large_malloc(size, allocation));
+    }
+
+    void free_storage(u8* address, Allocation allocation)
+    {
+        if (allocation == Allocation::DEFAULT)
+        {
+            delete[] address;
+        }
+        else
+        {
+            large_free(address);
+        }
+    }
+
+    // -----------------------------------------------------------------------
+    // Arena
+    // -----------------------------------------------------------------------
+
+    struct Arena::Chunk
+    {
+        enum { HEADER_SIZE = 64 };
+
+        Chunk* next;
+        size_t size;
+        std::atomic<size_t> offset;
+
+        Chunk(Chunk* next, size_t size)
+            : next(next)
+            , size(size)
+            , offset(0)
+        {
+        }
+
+        u8* data()
+        {
+            return reinterpret_cast<u8*>(this) + HEADER_SIZE;
+        }
+
+        void* allocate(size_t bytes, size_t alignment)
+        {
+            const uintptr_t base = reinterpret_cast<uintptr_t>(data());
+            size_t current = offset.load(std::memory_order_relaxed);
+
+            for (;;)
+            {
+                const uintptr_t address = (base + current + alignment - 1) & ~uintptr_t(alignment - 1);
+                const size_t end = size_t(address - base) + bytes;
+
+                if (end > size)
+                    return nullptr;
+
+                if (offset.compare_exchange_weak(current, end, std::memory_order_relaxed))
+                    return reinterpret_cast<void*>(address);
+            }
+        }
+    };
+
+    Arena::Arena(size_t chunkSize)
+        : m_current(nullptr)
+        , m_head(nullptr)
+        , m_chunk_size(chunkSize)
+    {
+    }
+
+    Arena::~Arena()
+    {
+        Chunk* chunk = m_head;
+        while (chunk)
+        {
+            Chunk* next = chunk->next;
+            chunk->~Chunk();
+            aligned_free(chunk);
+            chunk = next;
+        }
+    }
+
+    void* Arena::allocate(size_t bytes, size_t alignment)
+    {
+        assert(u32_is_power_of_two(u32(alignment)));
+
+        Chunk* chunk = m_current.load(std::memory_order_acquire);
+
+        for (;;)
+        {
+            if (chunk)
+            {
+                void* address = chunk->allocate(bytes, alignment);
+                if (address)
+                    return address;
+            }
+
+            chunk = grow(chunk, bytes, alignment);
+        }
+    }
+
+    Arena::Chunk* Arena::grow(Chunk* chunk, size_t bytes, size_t alignment)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        Chunk* current = m_current.load(std::memory_order_relaxed);
+        if (current != chunk)
+        {
+            // another thread moved to the next chunk
+            return current;
+        }
+
+        const size_t required = bytes + alignment;
+
+        // continue with the chunk which was used before the previous release
+        Chunk** link = chunk ? &chunk->next : &m_head;
+        Chunk* next = *link;
+
+        if (next && next->size >= required)
+        {
+            next->offset.store(0, std::memory_order_relaxed);
+        }
+        else
+        {
+            const size_t size = std::max(m_chunk_size, required);
+            void* memory = aligned_malloc(Chunk::HEADER_SIZE + size, Chunk::HEADER_SIZE);
+            if (!memory)
+            {
+                throw std::bad_alloc();
+            }
+
+            next = new (memory) Chunk(next, size);
+            *link = next;
+        }
+
+        m_current.store(next, std::memory_order_release);
+        return next;
+    }
+
+    Arena::Marker Arena::mark() const
+    {
+        Marker marker;
+        marker.chunk = m_current.load(std::memory_order_relaxed);
+        marker.offset = marker.chunk ? marker.chunk->offset.load(std::memory_order_relaxed) : 0;
+        return marker;
+    }
+
+    void Arena::release(const Marker& marker)
+    {
+        if (marker.chunk)
+        {
+            marker.chunk->offset.store(marker.offset, std::memory_order_relaxed);
+        }
+
+        m_current.store(marker.chunk, std::memory_order_relaxed);
+    }
+
+    void Arena::reset()
+    {
+        m_current.store(nullptr, std::memory_order_relaxed);
+    }
+
+    size_t Arena::capacity() const
+    {
+        size_t bytes = 0;
+
+        for (Chunk* chunk = m_head; chunk; chunk = chunk->next)
+        {
+            bytes += chunk->size;
+        }
+
+        return bytes;
+    }
+
+    // -----------------------------------------------------------------------
+    // ScratchScope
+    // -----------------------------------------------------------------------
+
+    Arena& getScratchArena()
+    {
+        static thread_local Arena arena(64 * 1024);
+        return arena;
+    }
+
+} // namespace mango
@@ -2,6 +2,8 @@
     MANGO Multimedia Development Platform
     Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
 */
+#include <algorithm>
+#include <cstring>
 #include <mango/core/hash.hpp>
 #include <mango/core/exception.hpp>
 #include <mango/core/bits.hpp>
@@ -359,7 +361,7 @@ namespace {
         }
 
         abcd = _mm_shuffle_epi32(abcd, 0x1B);
-        _mm_store_si128((__m128i*) digest, abcd);
+        _mm_storeu_si128((__m128i*) digest, abcd);
         *(digest+4) = _mm_extract_epi32(e0, 3);
     }
 
@@ -505,6 +507,8 @@ namespace {
             state[2] += c;
             state[3] += d;
             state[4] += e;
+
+            block += 64;
         }
     }
 
@@ -512,61 +516,106 @@ namespace {
 
 namespace mango {
 
-    void sha1(u32 hash[5], Memory memory)
+    // ----------------------------------------------------------------------------------------
+    // SHA1
+    // ----------------------------------------------------------------------------------------
+
+    SHA1::SHA1()
+        : m_length(0)
     {
-        hash[0] = 0x67452301;
-        hash[1] = 0xEFCDAB89;
-        hash[2] = 0x98BADCFE;
-        hash[3] = 0x10325476;
-        hash[4] = 0xC3D2E1F0;
+        m_state[0] = 0x67452301;
+        m_state[1] = 0xEFCDAB89;
+        m_state[2] = 0x98BADCFE;
+        m_state[3] = 0x10325476;
+        m_state[4] = 0xC3D2E1F0;
 
-        auto transform = generic_sha1_update;
+        m_transform = generic_sha1_update;
 #if defined(__ARM_FEATURE_CRYPTO)
         if ((getCPUFlags() & CPU_ARM_SHA1) != 0)
         {
-            transform = arm_sha1_update;
+            m_transform = arm_sha1_update;
         }
 #elif defined(MANGO_ENABLE_SHA)
         if ((getCPUFlags() & CPU_SHA) != 0)
         {
-            transform = intel_sha1_update;
+            m_transform = intel_sha1_update;
         }
 #endif
+    }
 
-        const u32 len = u32(memory.size);
+    void SHA1::update(Memory memory)
+    {
         const u8* message = memory.address;
+        size_t size = memory.size;
 
-        int block_count = len / 64;
-        transform(hash, message, block_count);
-        message += block_count * 64;
-        u32 i = block_count * 64;
-
-        u8 block[64];
-        u32 rem = len - i;
-        memcpy(block, message + i, rem);
+        size_t used = size_t(m_length & 63);
+        m_length += size;
 
-        block[rem++] = 0x80;
-        if (64 - rem >= 8)
+        if (used)
         {
-            memset(block + rem, 0, 56 - rem);
+            // complete the buffered block first
+            size_t bytes = std::min(size, 64 - used);
+            std::memcpy(m_block + used, message, bytes);
+            message += bytes;
+            size -= bytes;
+            used += bytes;
+
+            if (used < 64)
+                return;
+
+            m_transform(m_state, m_block, 1);
         }
-        else
+
+        while (size >= 64)
         {
-            memset(block + rem, 0, 64 - rem);
-            transform(hash, block, 1);
-            memset(block, 0, 56);
+            // the block count is an int; keep the batches in range
+            const size_t count = std::min(size / 64, size_t(1) << 24);
+            m_transform(m_state, message, int(count));
+            message += count * 64;
+            size -= count * 64;
         }
 
-        ustore64be(block + 56, memory.size * 8);
-        transform(hash, block, 1);
+        std::memcpy(m_block, message, size);
+    }
+
+    void SHA1::final(u32 hash[5])
+    {
+        const u64 length = m_length;
+
+        u8 padding[72] = { 0x80 };
+        const size_t used = size_t(length & 63);
+        const size_t bytes = used < 56 ? 56 - used : 120 - used;
+
+        update(Memory(padding, bytes));
+
+        u8 bits[8];
+        ustore64be(bits, length * 8);
+        update(Memory(bits, 8));
 
 #ifdef MANGO_LITTLE_ENDIAN
-        hash[0] = byteswap(hash[0]);
-        hash[1] = byteswap(hash[1]);
-        hash[2] = byteswap(hash[2]);
-        hash[3] = byteswap(hash[3]);
-        hash[4] = byteswap(hash[4]);
+        hash[0] = byteswap(m_state[0]);
+        hash[1] = byteswap(m_state[1]);
+        hash[2] = byteswap(m_state[2]);
+        hash[3] = byteswap(m_state[3]);
+        hash[4] = byteswap(m_state[4]);
+#else
+        hash[0] = m_state[0];
+        hash[1] = m_state[1];
+        hash[2] = m_state[2];
+        hash[3] = m_state[3];
+        hash[4] = m_state[4];
 #endif
     }
 
+    // ----------------------------------------------------------------------------------------
+    // sha1()
+    // ----------------------------------------------------------------------------------------
+
+    void sha1(u32 hash[5], Memory memory)
+    {
+        SHA1 context;
+        context.update(memory);
+        context.final(hash);
+    }
+
 } // namespace mango
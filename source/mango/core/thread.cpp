@@ -2,13 +2,53 @@
     MANGO Multimedia Development Platform
     Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
 */
-#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <deque>
 #include <mango/core/thread.hpp>
+#include <mango/core/memory.hpp>
+#include <mango/core/cpuinfo.hpp>
+#include <mango/core/trace.hpp>
 #include "../../external/concurrentqueue/concurrentqueue.h"
 
-using std::chrono::high_resolution_clock;
-using std::chrono::duration_cast;
-using std::chrono::milliseconds;
+// ------------------------------------------------------------
+// futex
+// ------------------------------------------------------------
+
+#if defined(MANGO_PLATFORM_LINUX)
+
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+    #define MANGO_ENABLE_FUTEX
+
+    static void futex_wait(std::atomic<mango::u32>* address, mango::u32 value, const struct timespec* timeout = nullptr)
+    {
+        syscall(SYS_futex, reinterpret_cast<mango::u32*>(address), FUTEX_WAIT_PRIVATE, value, timeout, nullptr, 0);
+    }
+
+    static void futex_wake(std::atomic<mango::u32>* address, int count)
+    {
+        syscall(SYS_futex, reinterpret_cast<mango::u32*>(address), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+    }
+
+#endif
+
+// ------------------------------------------------------------
+// cpu_pause
+// ------------------------------------------------------------
+
+    static inline void cpu_pause()
+    {
+#if defined(MANGO_ENABLE_SSE2)
+        _mm_pause();
+#elif defined(MANGO_CPU_ARM) && (defined(MANGO_COMPILER_GCC) || defined(MANGO_COMPILER_CLANG))
+        __asm__ __volatile__("yield");
+#else
+        std::this_thread::yield();
+#endif
+    }
 
 // ------------------------------------------------------------
 // thread affinity
@@ -19,31 +59,35 @@ using std::chrono::milliseconds;
 #include <pthread.h>
 
     template <typename H>
-    static void set_thread_affinity(H handle, int processor)
+    static void set_thread_affinity(H handle, const std::vector<int>& processors)
     {
         cpu_set_t cpuset;
 
         CPU_ZERO(&cpuset);
-        CPU_SET(processor, &cpuset);
+        for (int processor : processors)
+        {
+            CPU_SET(processor, &cpuset);
+        }
         pthread_setaffinity_np(handle, sizeof(cpu_set_t), &cpuset);
     }
 
-    static void set_current_thread_affinity(int processor)
-    {
-        set_thread_affinity(pthread_self(), processor);
-    }
-
 #elif defined(MANGO_PLATFORM_WINDOWS)
 
     template <typename H>
-    static void set_thread_affinity(H handle, int processor)
+    static void set_thread_affinity(H handle, const std::vector<int>& processors)
     {
-        SetThreadAffinityMask(handle, DWORD_PTR(1) << processor);
-    }
+        // NOTE: only the first processor group (64 processors) is supported
+        DWORD_PTR mask = 0;
+        for (int processor : processors)
+        {
+            if (processor < 64)
+                mask |= DWORD_PTR(1) << processor;
+        }
 
-    static void set_current_thread_affinity(int processor)
-    {
-        set_thread_affinity(GetCurrentThread(), processor);
+        if (mask)
+        {
+            SetThreadAffinityMask(handle, mask);
+        }
     }
 
 #else
@@ -51,15 +95,10 @@ using std::chrono::milliseconds;
     // TODO: iOS, macOS, Android
 
     template <typename H>
-    static void set_thread_affinity(H handle, int processor)
+    static void set_thread_affinity(H handle, const std::vector<int>& processors)
     {
         MANGO_UNREFERENCED_PARAMETER(handle);
-        MANGO_UNREFERENCED_PARAMETER(processor);
-    }
-
-    static void set_current_thread_affinity(int processor)
-    {
-        MANGO_UNREFERENCED_PARAMETER(processor);
+        MANGO_UNREFERENCED_PARAMETER(processors);
     }
 
 #endif
@@ -89,287 +128,1714 @@ namespace mango
 {
 
     // ------------------------------------------------------------
-    // TaskQueue
+    // task storage
     // ------------------------------------------------------------
 
-    struct TaskQueue
+    namespace detail
     {
-        using Task = ThreadPool::Task;
-        moodycamel::ConcurrentQueue<Task> tasks;
-    };
 
-    // ------------------------------------------------------------
-    // ThreadPool
-    // ------------------------------------------------------------
+        template <size_t Size>
+        struct alignas(16) TaskStorageBlock
+        {
+            u8 data[Size];
+        };
 
-    ThreadPool::ThreadPool(size_t size)
-        : m_queue_cache(32)
-        , m_queues(nullptr)
-        , m_threads(size)
-    {
-        m_queues = new TaskQueue[3];
-        m_static_queue = createQueue("static", int(Priority::NORMAL));
+        // size classes for callables which don't fit in TaskFunction
+        static constexpr size_t g_task_storage_max = 1024;
 
-        // NOTE: let OS scheduler shuffle tasks as it sees fit
-        //       this gives better performance overall UNTIL we have some practical
-        //       use for the affinity (eg. dependent tasks using same cache)
-        const bool affinity = false;//std::thread::hardware_concurrency() > 1;
-		if (affinity)
+        struct TaskStorage
         {
-            set_current_thread_affinity(0);
-        }
+            ObjectCache<TaskStorageBlock<128>> cache128 { 64 };
+            ObjectCache<TaskStorageBlock<256>> cache256 { 64 };
+            ObjectCache<TaskStorageBlock<512>> cache512 { 32 };
+            ObjectCache<TaskStorageBlock<1024>> cache1024 { 32 };
+        };
 
-        for (size_t i = 0; i < size; ++i)
+        static TaskStorage& getTaskStorage()
         {
-            m_threads[i] = std::thread([this, i] {
-                thread(i);
-            });
+            // NOTE: intentionally leaked; tasks can be released by the ThreadPool
+            //       destructor after the static destructors have been called
+            static TaskStorage* storage = new TaskStorage();
+            return *storage;
+        }
 
-			if (affinity)
+        void* allocateTaskStorage(size_t size, size_t alignment)
+        {
+            if (size > g_task_storage_max || alignment > 16)
             {
-                set_thread_affinity(get_native_handle(m_threads[i]), int(i + 1));
+                return aligned_malloc(size, std::max(alignment, size_t(16)));
             }
-        }
-    }
 
-    ThreadPool::~ThreadPool()
-    {
-        m_stop = true;
-        m_condition.notify_all();
+            TaskStorage& storage = getTaskStorage();
 
-        for (auto& thread : m_threads)
+            if (size <= 128) return storage.cache128.acquire();
+            if (size <= 256) return storage.cache256.acquire();
+            if (size <= 512) return storage.cache512.acquire();
+            return storage.cache1024.acquire();
+        }
+
+        void freeTaskStorage(void* address, size_t size, size_t alignment)
         {
-            thread.join();
+            if (size > g_task_storage_max || alignment > 16)
+            {
+                aligned_free(address);
+                return;
+            }
+
+            TaskStorage& storage = getTaskStorage();
+
+            if (size <= 128) storage.cache128.discard(reinterpret_cast<TaskStorageBlock<128>*>(address));
+            else if (size <= 256) storage.cache256.discard(reinterpret_cast<TaskStorageBlock<256>*>(address));
+            else if (size <= 512) storage.cache512.discard(reinterpret_cast<TaskStorageBlock<512>*>(address));
+            else storage.cache1024.discard(reinterpret_cast<TaskStorageBlock<1024>*>(address));
         }
 
-        deleteQueue(m_static_queue);
-        delete[] m_queues;
-    }
+    } // namespace detail
 
-    ThreadPool& ThreadPool::getInstance()
+    // ------------------------------------------------------------
+    // EventCount
+    // ------------------------------------------------------------
+
+    u32 EventCount::prepareWait()
     {
-        static ThreadPool instance(std::max(std::thread::hardware_concurrency() - 0, 1U));
-        return instance;
+        m_waiters.fetch_add(1, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return m_epoch.load(std::memory_order_acquire);
     }
 
-    int ThreadPool::getInstanceSize()
+    void EventCount::cancelWait()
     {
-        ThreadPool& pool = getInstance();
-        return pool.size();
+        m_waiters.fetch_sub(1, std::memory_order_seq_cst);
     }
 
-    int ThreadPool::size() const
+    void EventCount::commitWait(u32 key)
     {
-        return int(m_threads.size());
+#if defined(MANGO_ENABLE_FUTEX)
+        while (m_epoch.load(std::memory_order_acquire) == key)
+        {
+            futex_wait(&m_epoch, key);
+        }
+#else
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (m_epoch.load(std::memory_order_acquire) == key)
+        {
+            m_condition.wait(lock);
+        }
+#endif
+        m_waiters.fetch_sub(1, std::memory_order_seq_cst);
     }
 
-    void ThreadPool::thread(size_t threadID)
+    bool EventCount::commitWait(u32 key, u32 milliseconds)
     {
-        auto time0 = high_resolution_clock::now();
+        using Clock = std::chrono::steady_clock;
+        const Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(milliseconds);
 
-        while (!m_stop.load(std::memory_order_relaxed))
+        bool notified = true;
+
+#if defined(MANGO_ENABLE_FUTEX)
+        while (m_epoch.load(std::memory_order_acquire) == key)
         {
-            if (dequeue_and_process())
+            auto remaining = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - Clock::now()).count();
+            if (remaining <= 0)
             {
-                // remember the last time we processed a task
-                time0 = high_resolution_clock::now();
+                notified = false;
+                break;
             }
-            else
+
+            struct timespec timeout;
+            timeout.tv_sec = time_t(remaining / 1000000000);
+            timeout.tv_nsec = long(remaining % 1000000000);
+            futex_wait(&m_epoch, key, &timeout);
+        }
+#else
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (m_epoch.load(std::memory_order_acquire) == key)
+        {
+            if (m_condition.wait_until(lock, deadline) == std::cv_status::timeout)
             {
-                // don't be too eager to sleep
-                auto time1 = high_resolution_clock::now();
-                auto elapsed = duration_cast<milliseconds>(time1 - time0).count();
-                if (elapsed >= milliseconds(2).count())
-                {
-                    // sleep but check what's happening after a while unless signaled
-                    ++m_sleep_count;
-                    std::unique_lock<std::mutex> lock(m_queue_mutex);
-                    m_condition.wait_for(lock, milliseconds(32));
-                    --m_sleep_count;
-                }
-                else
-                {
-                    // no work; yield and try again soon
-                    std::this_thread::yield();
-                }
+                notified = m_epoch.load(std::memory_order_acquire) != key;
+                break;
             }
         }
+#endif
+        m_waiters.fetch_sub(1, std::memory_order_seq_cst);
+        return notified;
     }
 
-    void ThreadPool::enqueue(Queue* queue, std::function<void()>&& func)
+    bool EventCount::notifyOne()
     {
-        Task task;
-        task.queue = queue;
-        task.stamp = queue->task_input_count++;
-        task.func = std::move(func);
-
-        m_queues[queue->priority].tasks.enqueue(std::move(task));
-
-        if (m_sleep_count > 0)
+        // the caller has published the condition; make sure the waiter count
+        // we read is not older than the condition the waiters are checking
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!m_waiters.load(std::memory_order_relaxed))
+            return false;
+
+#if defined(MANGO_ENABLE_FUTEX)
+        m_epoch.fetch_add(1, std::memory_order_acq_rel);
+        futex_wake(&m_epoch, 1);
+#else
         {
-            m_condition.notify_one();
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_epoch.fetch_add(1, std::memory_order_acq_rel);
         }
+        m_condition.notify_one();
+#endif
+        return true;
     }
 
-    bool ThreadPool::dequeue_and_process()
+    bool EventCount::notify(int count)
     {
-        // scan task queues in priority order
-        for (size_t priority = 0; priority < 3; ++priority)
-        {
-            Task task;
-            if (m_queues[priority].tasks.try_dequeue(task))
-            {
-                Queue* queue = task.queue;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!m_waiters.load(std::memory_order_relaxed))
+            return false;
 
-                // check if the task is cancelled
-                if (task.stamp > queue->stamp_cancel)
-                {
-                    // process task
-                    task.func();
-                }
-
-                ++queue->task_complete_count;
-                return true;
-            }
+#if defined(MANGO_ENABLE_FUTEX)
+        m_epoch.fetch_add(1, std::memory_order_acq_rel);
+        futex_wake(&m_epoch, count);
+#else
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_epoch.fetch_add(1, std::memory_order_acq_rel);
         }
 
-        return false;
+        if (count > 1)
+        {
+            m_condition.notify_all();
+        }
+        else
+        {
+            m_condition.notify_one();
+        }
+#endif
+        return true;
     }
 
-    void ThreadPool::wait(Queue* queue)
+    bool EventCount::notifyAll()
     {
-        // NOTE: we might be waiting here a while if other threads keep enqueuing tasks
-        while (queue->task_complete_count < queue->task_input_count)
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!m_waiters.load(std::memory_order_relaxed))
+            return false;
+
+#if defined(MANGO_ENABLE_FUTEX)
+        m_epoch.fetch_add(1, std::memory_order_acq_rel);
+        futex_wake(&m_epoch, INT_MAX);
+#else
         {
-            if (!dequeue_and_process())
-            {
-                std::this_thread::yield();
-            }
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_epoch.fetch_add(1, std::memory_order_acq_rel);
         }
+        m_condition.notify_all();
+#endif
+        return true;
     }
 
-    void ThreadPool::cancel(Queue* queue)
-    {
-        queue->stamp_cancel = queue->task_input_count.load() - 1;
-    }
+    // ------------------------------------------------------------
+    // TaskQueue
+    // ------------------------------------------------------------
 
-    ThreadPool::Queue* ThreadPool::createQueue(const std::string& name, int priority)
-    {
-        Queue* queue = m_queue_cache.acquire();
+    /*
+        TaskQueue is the round-robin list of the queues which have tasks waiting for
+        a worker. The queue in front has it's tasks dequeued until it's deficit runs out
+        and then it moves to the back of the list (deficit round-robin with unit cost),
+        so a queue with thousands of pending tasks does not delay a queue with one.
 
-        queue->pool = this;
-        queue->priority = priority;
-        queue->task_input_count = 0;
-        queue->task_complete_count = 0;
-        queue->stamp_cancel = -1;
-        queue->name = name;
+        The tasks themselves are in a lock-free queue per Queue (QueueTasks); only the
+        round-robin list is locked, and only by the dequeuing workers and when a queue
+        enters the list.
+    */
 
-        return queue;
-    }
+    struct QueueTasks
+    {
+        moodycamel::ConcurrentQueue<ThreadPool::Task> tasks;
+    };
 
-    void ThreadPool::deleteQueue(Queue* queue)
+    ThreadPool::Queue::~Queue()
     {
-        m_queue_cache.discard(queue);
+        delete tasks;
     }
 
+    struct TaskQueue
+    {
+        using Queue = ThreadPool::Queue;
+
+        SpinLock lock;
+        std::deque<Queue*> queues;
+        std::atomic<size_t> count { 0 };
+
+        void count_update()
+        {
+            count.store(queues.size(), std::memory_order_release);
+        }
+    };
+
     // ------------------------------------------------------------
-    // ConcurrentQueue
+    // WorkStealingQueue
     // ------------------------------------------------------------
 
-    ConcurrentQueue::ConcurrentQueue()
-        : m_pool(ThreadPool::getInstance())
-    {
-        m_queue = m_pool.createQueue("concurrent.default", int(Priority::NORMAL));
-    }
+    /*
+        Every worker thread owns one WorkStealingQueue per priority level. Tasks
+        enqueued from inside a task go into the current worker's own queue; the owner
+        pushes and pops at the back (LIFO) so nested work runs while its data is still
+        in cache. Idle workers steal from the front (FIFO), which gives them the oldest
+        and usually the largest pieces of work.
+    */
 
-    ConcurrentQueue::ConcurrentQueue(const std::string& name, Priority priority)
-        : m_pool(ThreadPool::getInstance())
+    struct WorkStealingQueue
     {
-        m_queue = m_pool.createQueue(name, int(priority));
-    }
+        using Task = ThreadPool::Task;
 
-    ConcurrentQueue::~ConcurrentQueue()
-    {
-        wait();
-        m_pool.deleteQueue(m_queue);
-    }
+        SpinLock lock;
+        std::deque<Task> tasks;
+        std::atomic<size_t> count { 0 };
 
-    void ConcurrentQueue::cancel()
-    {
-        m_pool.cancel(m_queue);
-    }
+        void count_update()
+        {
+            count.store(tasks.size(), std::memory_order_release);
+        }
 
-    void ConcurrentQueue::wait()
-    {
-        m_pool.wait(m_queue);
-    }
+        void push(Task&& task)
+        {
+            SpinLockGuard guard(lock);
+            tasks.push_back(std::move(task));
+            count_update();
+        }
 
-    // ------------------------------------------------------------
-    // SerialQueue
-    // ------------------------------------------------------------
+        void push(Task* source, size_t count)
+        {
+            SpinLockGuard guard(lock);
+            for (size_t i = 0; i < count; ++i)
+            {
+                tasks.push_back(std::move(source[i]));
+            }
+            count_update();
+        }
 
-    SerialQueue::SerialQueue()
-        : m_name("serial.default")
+        bool pop(Task& task)
+        {
+            // peek without locking; idle workers poll this a lot
+            if (!count.load(std::memory_order_acquire))
+                return false;
+
+            SpinLockGuard guard(lock);
+            if (tasks.empty())
+                return false;
+
+            task = std::move(tasks.back());
+            tasks.pop_back();
+            count_update();
+            return true;
+        }
+
+        bool steal(Task& task)
+        {
+            if (!count.load(std::memory_order_acquire))
+                return false;
+
+            SpinLockGuard guard(lock);
+            if (tasks.empty())
+                return false;
+
+            task = std::move(tasks.front());
+            tasks.pop_front();
+            count_update();
+            return true;
+        }
+    };
+
+    // identifies the ThreadPool worker running on the current thread (if any)
+    struct WorkerContext
     {
-        m_thread = std::thread([this] {
-            thread();
-        });
-    }
+        ThreadPool* pool;
+        size_t index;
+    };
 
-    SerialQueue::SerialQueue(const std::string& name)
-        : m_name(name)
+    static thread_local WorkerContext g_worker_context = { nullptr, 0 };
+
+    static u64 get_time_us()
     {
-        m_thread = std::thread([this] {
-            thread();
-        });
+        auto time = std::chrono::steady_clock::now().time_since_epoch();
+        return u64(std::chrono::duration_cast<std::chrono::microseconds>(time).count());
     }
 
-    SerialQueue::~SerialQueue()
+    // the task running on the current thread (if any); the queue outlives it's running
+    // tasks so the state is promoted to a shared reference only when a token is requested
+    struct CurrentTask
     {
-        wait();
+        const ThreadPool::CancelState* state;
+        int stamp;
+    };
 
-        m_stop = true;
-        m_condition.notify_one();
-        m_thread.join();
-    }
+    static thread_local CurrentTask g_current_task = { nullptr, 0 };
+    static thread_local int g_task_depth = 0;
 
-    void SerialQueue::thread()
+    // ------------------------------------------------------------
+    // statistics
+    // ------------------------------------------------------------
+
+    struct AtomicHistogram
     {
-        while (!m_stop.load(std::memory_order_relaxed))
+        std::atomic<u64> count[Histogram::BUCKETS];
+        std::atomic<u64> sum;
+
+        AtomicHistogram()
         {
-            std::unique_lock<std::mutex> queue_lock(m_queue_mutex);
-            if (!m_task_queue.empty())
+            for (auto& c : count)
             {
-                auto task = m_task_queue.front();
-                m_task_queue.pop_front();
-                queue_lock.unlock();
-
-                task();
-                --m_task_counter;
+                c = 0;
             }
-            else
+            sum = 0;
+        }
+
+        void add(u64 microseconds)
+        {
+            count[Histogram::bucket(microseconds)].fetch_add(1, std::memory_order_relaxed);
+            sum.fetch_add(microseconds, std::memory_order_relaxed);
+        }
+
+        void read(Histogram& histogram) const
+        {
+            for (int i = 0; i < Histogram::BUCKETS; ++i)
             {
-                m_condition.wait_for(queue_lock, milliseconds(32));
+                histogram.count[i] = count[i].load(std::memory_order_relaxed);
             }
+            histogram.sum = sum.load(std::memory_order_relaxed);
         }
-    }
+    };
 
-    void SerialQueue::cancel()
+    struct QueueCounters
     {
-        std::unique_lock<std::mutex> queue_lock(m_queue_mutex);
-        m_task_counter -= u32(m_task_queue.size());
-        m_task_queue.clear();
-    }
+        std::string name;
+        u64 created;
+        std::atomic<u64> enqueued { 0 };
+        std::atomic<u64> started { 0 };
+        std::atomic<u64> completed { 0 };
+        std::atomic<u64> cancelled { 0 };
+        AtomicHistogram latency;
+        AtomicHistogram runtime;
+    };
 
-    void SerialQueue::wait()
+    // written only by the owning worker
+    struct alignas(64) WorkerCounters
     {
-        for (;;)
+        std::atomic<u64> tasks { 0 };
+        std::atomic<u64> steals { 0 };
+        std::atomic<u64> sleeps { 0 };
+        std::atomic<u64> busy { 0 };
+        std::atomic<u64> parked { 0 };
+        std::atomic<u64> parked_since { 0 }; // time the worker was parked (0: running)
+
+        void increment(std::atomic<u64>& counter, u64 value = 1)
         {
-            if (!m_task_counter.load(std::memory_order_relaxed))
-                break;
+            // single writer; no need for a locked read-modify-write
+            counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+        }
+    };
+
+    // ------------------------------------------------------------
+    // ThreadPool
+    // ------------------------------------------------------------
 
-            // NOTE: we are wasting CPU here and we know it
-            std::this_thread::sleep_for(std::chrono::microseconds(10));
+    ThreadPool::ThreadPool(size_t size, Affinity affinity)
+        : m_queue_cache(32)
+        , m_queues(nullptr)
+        , m_local_queues(nullptr)
+        , m_node_count(1)
+        , m_worker_node(size, 0)
+        , m_aging_period(10000)
+        , m_threads(size)
+    {
+        for (int i = 0; i < 3; ++i)
+        {
+            m_pending[i] = 0;
+            m_served[i] = 0;
+        }
+
+        for (auto& counters : m_counters_index)
+        {
+            counters = nullptr;
+        }
+
+        // processor sets the workers are pinned to, in the order they are assigned
+        std::vector<std::vector<int>> groups;
+        std::vector<int> group_node;
+
+        if (affinity != Affinity::NONE)
+        {
+            const CPUTopology& topology = getCPUTopology();
+
+            const bool core = affinity == Affinity::CORE;
+            const int count = core ? topology.cores : topology.caches;
+
+            std::vector<std::vector<int>> processors(count);
+            std::vector<int> node(count, 0);
+
+            for (auto& processor : topology.processors)
+            {
+                int index = core ? processor.core : processor.cache;
+                processors[index].push_back(processor.id);
+                node[index] = processor.node;
+            }
+
+            // interleave the nodes so that a small pool is spread over all of them
+            for (int rank = 0; rank < count && int(groups.size()) < count; ++rank)
+            {
+                for (int n = 0; n < topology.nodes; ++n)
+                {
+                    int seen = 0;
+                    for (int i = 0; i < count; ++i)
+                    {
+                        if (node[i] == n && seen++ == rank)
+                        {
+                            groups.push_back(processors[i]);
+                            group_node.push_back(n);
+                            break;
+                        }
+                    }
+                }
+            }
+
+            m_node_count = topology.nodes;
+        }
+
+        m_start_time = get_time_us();
+        // NOTE: operator new does not respect the alignment before C++17
+        m_worker_counters = reinterpret_cast<WorkerCounters*>(aligned_malloc(sizeof(WorkerCounters) * size, 64));
+        for (size_t i = 0; i < size; ++i)
+        {
+            new (m_worker_counters + i) WorkerCounters();
+        }
+
+        m_queues = new TaskQueue[(m_node_count + 1) * 3];
+        m_local_queues = new WorkStealingQueue[size * 3];
+        m_static_queue = createQueue("static", int(Priority::NORMAL));
+
+        for (size_t i = 0; i < size; ++i)
+        {
+            if (!groups.empty())
+            {
+                m_worker_node[i] = group_node[i % groups.size()];
+            }
+
+            m_threads[i] = std::thread([this, i] {
+                thread(i);
+            });
+
+            if (!groups.empty())
+            {
+                set_thread_affinity(get_native_handle(m_threads[i]), groups[i % groups.size()]);
+            }
+        }
+    }
+
+    ThreadPool::~ThreadPool()
+    {
+        m_stop = true;
+        m_idle_event.notifyAll();
+
+        for (auto& thread : m_threads)
+        {
+            thread.join();
+        }
+
+        deleteQueue(m_static_queue);
+        delete[] m_local_queues;
+        delete[] m_queues;
+        aligned_free(m_worker_counters);
+    }
+
+    namespace
+    {
+        std::mutex g_instance_mutex;
+        bool g_instance_created = false;
+        bool g_instance_configured = false;
+        size_t g_instance_size = 0;
+        ThreadPool::Affinity g_instance_affinity = ThreadPool::Affinity::NONE;
+
+        void readInstanceEnvironment(size_t& size, ThreadPool::Affinity& affinity)
+        {
+            const char* threads = std::getenv("MANGO_THREADS");
+            if (threads)
+            {
+                char* end = nullptr;
+                long value = std::strtol(threads, &end, 10);
+                if (end != threads && value > 0)
+                {
+                    size = size_t(value);
+                }
+            }
+
+            const char* mode = std::getenv("MANGO_THREAD_AFFINITY");
+            if (mode)
+            {
+                std::string text(mode);
+                if (text == "core")
+                    affinity = ThreadPool::Affinity::CORE;
+                else if (text == "cache")
+                    affinity = ThreadPool::Affinity::CACHE;
+                else if (text == "none")
+                    affinity = ThreadPool::Affinity::NONE;
+            }
+        }
+
+        struct InstanceConfig
+        {
+            size_t size;
+            ThreadPool::Affinity affinity;
+        };
+
+        InstanceConfig getInstanceConfig()
+        {
+            std::lock_guard<std::mutex> lock(g_instance_mutex);
+
+            if (!g_instance_configured)
+            {
+                g_instance_size = std::max(std::thread::hardware_concurrency(), 1U);
+                readInstanceEnvironment(g_instance_size, g_instance_affinity);
+            }
+
+            g_instance_created = true;
+
+            InstanceConfig config;
+            config.size = std::max(g_instance_size, size_t(1));
+            config.affinity = g_instance_affinity;
+            return config;
+        }
+
+    } // namespace
+
+    void ThreadPool::configureInstance(size_t size, Affinity affinity)
+    {
+        std::lock_guard<std::mutex> lock(g_instance_mutex);
+
+        if (g_instance_created)
+        {
+            MANGO_EXCEPTION("[ThreadPool] The default instance has already been created.");
+        }
+
+        g_instance_configured = true;
+        g_instance_size = size;
+        g_instance_affinity = affinity;
+    }
+
+    ThreadPool& ThreadPool::getInstance()
+    {
+        static const InstanceConfig config = getInstanceConfig();
+        static ThreadPool instance(config.size, config.affinity);
+        return instance;
+    }
+
+    int ThreadPool::getInstanceSize()
+    {
+        ThreadPool& pool = getInstance();
+        return pool.size();
+    }
+
+    int ThreadPool::size() const
+    {
+        return int(m_threads.size());
+    }
+
+    int ThreadPool::nodes() const
+    {
+        return m_node_count;
+    }
+
+    ThreadPoolStatistics ThreadPool::getStatistics() const
+    {
+        ThreadPoolStatistics stats;
+
+        const u64 time = get_time_us();
+        stats.time = time - m_start_time;
+        stats.wakeups = m_wakeups.load(std::memory_order_relaxed);
+        stats.timing = m_timing.load(std::memory_order_relaxed);
+
+        {
+            std::lock_guard<std::mutex> lock(m_counters_mutex);
+
+            for (auto& entry : m_queue_counters)
+            {
+                const QueueCounters* counters = entry.second.get();
+                QueueStatistics queue;
+
+                queue.name = counters->name;
+                queue.enqueued = counters->enqueued.load(std::memory_order_relaxed);
+                queue.started = counters->started.load(std::memory_order_relaxed);
+                queue.completed = counters->completed.load(std::memory_order_relaxed);
+                queue.cancelled = counters->cancelled.load(std::memory_order_relaxed);
+                counters->latency.read(queue.latency);
+                counters->runtime.read(queue.runtime);
+
+                const u64 elapsed = time - counters->created;
+                queue.throughput = elapsed ? double(queue.completed) * 1000000.0 / double(elapsed) : 0.0;
+
+                stats.queues.push_back(queue);
+            }
+        }
+
+        for (size_t i = 0; i < m_threads.size(); ++i)
+        {
+            const WorkerCounters& counters = m_worker_counters[i];
+            WorkerStatistics worker;
+
+            worker.tasks = counters.tasks.load(std::memory_order_relaxed);
+            worker.steals = counters.steals.load(std::memory_order_relaxed);
+            worker.sleeps = counters.sleeps.load(std::memory_order_relaxed);
+            // include the time of the current park
+            u64 parked = counters.parked.load(std::memory_order_relaxed);
+            const u64 since = counters.parked_since.load(std::memory_order_relaxed);
+            if (since)
+            {
+                parked += time - std::min(time, since);
+            }
+
+            worker.parked = std::min(parked, stats.time);
+
+            // the parked time is measured always, the time in tasks only with the timing
+            const u64 busy = stats.timing ? counters.busy.load(std::memory_order_relaxed) : stats.time - worker.parked;
+            worker.busy = std::min(busy, stats.time);
+            worker.idle = stats.time - worker.busy;
+
+            stats.workers.push_back(worker);
+        }
+
+        return stats;
+    }
+
+    void ThreadPool::setStatistics(bool enable)
+    {
+        m_timing = enable;
+    }
+
+    void ThreadPool::setAgingPeriod(int milliseconds)
+    {
+        m_aging_period = u64(std::max(milliseconds, 0)) * 1000;
+    }
+
+    size_t ThreadPool::getSharedQueueIndex(const Queue* queue) const
+    {
+        size_t group = 0;
+
+        if (queue->node >= 0 && queue->node < m_node_count)
+        {
+            group = queue->node + 1;
+        }
+
+        return group * 3 + queue->priority;
+    }
+
+    void ThreadPool::thread(size_t threadID)
+    {
+        g_worker_context.pool = this;
+        g_worker_context.index = threadID;
+
+#ifdef MANGO_ENABLE_TRACE
+        setTraceThreadName("worker " + std::to_string(threadID));
+#endif
+
+        // adaptive spinning: spin longer when spinning pays off, shorter when it doesn't
+        const int min_spin = 16;
+        const int max_spin = 1024;
+        int spin_limit = min_spin * 4;
+
+        while (!m_stop.load(std::memory_order_relaxed))
+        {
+            if (dequeue_and_process())
+                continue;
+
+            // no work; spin for a while before parking
+            bool found = false;
+
+            for (int spin = 0; spin < spin_limit; ++spin)
+            {
+                for (int i = 0; i < 32; ++i)
+                {
+                    cpu_pause();
+                }
+
+                if (dequeue_and_process())
+                {
+                    found = true;
+                    break;
+                }
+            }
+
+            if (found)
+            {
+                spin_limit = std::min(spin_limit * 2, max_spin);
+                continue;
+            }
+
+            spin_limit = std::max(spin_limit / 2, min_spin);
+
+            // park until new work is enqueued
+            u32 key = m_idle_event.prepareWait();
+
+            if (m_stop.load(std::memory_order_relaxed))
+            {
+                m_idle_event.cancelWait();
+                break;
+            }
+
+            if (dequeue_and_process())
+            {
+                m_idle_event.cancelWait();
+                continue;
+            }
+
+            WorkerCounters& counters = m_worker_counters[threadID];
+            counters.increment(counters.sleeps);
+
+            // parking is a system call anyway so the clock reads are cheap in comparison
+            const u64 time = get_time_us();
+            counters.parked_since.store(time, std::memory_order_relaxed);
+            m_idle_event.commitWait(key);
+            counters.increment(counters.parked, get_time_us() - time);
+            counters.parked_since.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void ThreadPool::wakeup(int count)
+    {
+        // wake up parked workers; if all workers are busy (or blocked in wait())
+        // wake up a waiting thread so that it can help
+        if (count > 0)
+        {
+            if (m_idle_event.notify(count))
+            {
+                m_wakeups.fetch_add(1, std::memory_order_relaxed);
+            }
+            else
+            {
+                m_wait_event.notifyOne();
+            }
+        }
+    }
+
+    void ThreadPool::enqueue_update(int priority, size_t count)
+    {
+        // the aging starts when the first task is waiting
+        if (!m_pending[priority].fetch_add(int(count)))
+        {
+            m_served[priority].store(get_time_us(), std::memory_order_relaxed);
+        }
+    }
+
+    void ThreadPool::enqueue(Queue* queue, TaskFunction&& func)
+    {
+        Task task;
+        task.queue = queue;
+        task.stamp = queue->task_input_count++;
+        task.time = m_timing.load(std::memory_order_relaxed) ? get_time_us() : 0;
+        task.func = std::move(func);
+
+        queue->counters->enqueued.fetch_add(1, std::memory_order_relaxed);
+        enqueue_update(queue->priority, 1);
+
+        // the limit is enforced in the round-robin list, so limited work is never local
+        if (g_worker_context.pool == this && !queue->limit)
+        {
+            // nested work stays on the current worker
+            size_t index = g_worker_context.index * 3 + queue->priority;
+            m_local_queues[index].push(std::move(task));
+        }
+        else
+        {
+            enqueue_shared(queue, &task, 1);
+        }
+
+        wakeup(1);
+    }
+
+    void ThreadPool::enqueue_bulk(Queue* queue, Task* tasks, size_t count)
+    {
+        if (!count)
+            return;
+
+        int stamp = queue->task_input_count.fetch_add(int(count));
+        u64 time = m_timing.load(std::memory_order_relaxed) ? get_time_us() : 0;
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            tasks[i].queue = queue;
+            tasks[i].stamp = stamp + int(i);
+            tasks[i].time = time;
+        }
+
+        queue->counters->enqueued.fetch_add(count, std::memory_order_relaxed);
+        enqueue_update(queue->priority, count);
+
+        int wakeup_count = int(std::min(count, m_threads.size()));
+
+        if (g_worker_context.pool == this && !queue->limit)
+        {
+            // the current worker keeps one task; the others are for stealing
+            size_t index = g_worker_context.index * 3 + queue->priority;
+            m_local_queues[index].push(tasks, count);
+            --wakeup_count;
+        }
+        else
+        {
+            enqueue_shared(queue, tasks, count);
+        }
+
+        wakeup(wakeup_count);
+    }
+
+    void ThreadPool::enqueue_shared(Queue* queue, Task* tasks, size_t count)
+    {
+        if (count == 1)
+        {
+            queue->tasks->tasks.enqueue(std::move(tasks[0]));
+        }
+        else
+        {
+            queue->tasks->tasks.enqueue_bulk(std::make_move_iterator(tasks), count);
+        }
+
+        queue->waiting.fetch_add(int(count));
+        activate(queue);
+    }
+
+    bool ThreadPool::activate(Queue* queue)
+    {
+        // enter the round-robin list unless the queue is already there; the waiting
+        // count and the flag are checked in the opposite order by dequeue_shared(),
+        // so either this or the dequeuing worker sees the new work
+        if (!queue->scheduled.load() && queue->waiting.load() > 0 && queue->runnable() &&
+            !queue->scheduled.exchange(true))
+        {
+            schedule(queue);
+            return true;
+        }
+
+        return false;
+    }
+
+    void ThreadPool::schedule(Queue* queue)
+    {
+        TaskQueue& list = m_queues[getSharedQueueIndex(queue)];
+
+        SpinLockGuard guard(list.lock);
+        list.queues.push_back(queue);
+        list.count_update();
+    }
+
+    void ThreadPool::configure(Queue* queue, int weight, int limit)
+    {
+        // negative values keep the current setting; a new weight applies from the next turn
+        if (weight >= 0)
+        {
+            queue->weight = std::max(weight, 1);
+        }
+
+        if (limit >= 0)
+        {
+            queue->limit = limit;
+        }
+
+        // raising the limit can release tasks which were held back
+        if (activate(queue))
+        {
+            wakeup(1);
+        }
+    }
+
+    bool ThreadPool::dequeue_and_process()
+    {
+        Task task;
+
+        // run starving lower priority work first
+        const u64 period = m_aging_period.load(std::memory_order_relaxed);
+        if (period)
+        {
+            for (int priority = 2; priority > 0; --priority)
+            {
+                if (!m_pending[priority].load(std::memory_order_relaxed))
+                    continue;
+
+                u64 served = m_served[priority].load(std::memory_order_relaxed);
+                u64 time = get_time_us();
+
+                // only one thread gets to run the aged task
+                if (time - served > period * priority &&
+                    m_served[priority].compare_exchange_strong(served, time) &&
+                    dequeue(priority, task))
+                {
+                    process(task);
+                    return true;
+                }
+            }
+        }
+
+        // scan task queues in priority order
+        for (size_t priority = 0; priority < 3; ++priority)
+        {
+            if (dequeue(priority, task))
+            {
+                process(task);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    bool ThreadPool::dequeue(size_t priority, Task& task)
+    {
+        const bool worker = g_worker_context.pool == this;
+        const int node = worker ? m_worker_node[g_worker_context.index] : -1;
+
+        bool found = false;
+
+        // own work first (LIFO)
+        if (worker && m_local_queues[g_worker_context.index * 3 + priority].pop(task))
+        {
+            found = true;
+        }
+
+        // shared work for our node, then shared work without node preference,
+        // then shared work for the other nodes
+        if (!found && node >= 0 && dequeue_shared((node + 1) * 3 + priority, task))
+        {
+            found = true;
+        }
+
+        for (int group = 0; !found && group <= m_node_count; ++group)
+        {
+            if (group == node + 1 && node >= 0)
+                continue;
+
+            found = dequeue_shared(group * 3 + priority, task);
+        }
+
+        // other workers' work (FIFO)
+        if (!found)
+        {
+            found = steal(priority, task);
+
+            if (found && worker)
+            {
+                WorkerCounters& counters = m_worker_counters[g_worker_context.index];
+                counters.increment(counters.steals);
+            }
+        }
+
+        if (found)
+        {
+            m_pending[priority].fetch_sub(1, std::memory_order_relaxed);
+
+            // HIGH priority work does not age
+            if (priority)
+            {
+                m_served[priority].store(get_time_us(), std::memory_order_relaxed);
+            }
+        }
+
+        return found;
+    }
+
+    bool ThreadPool::dequeue_shared(size_t index, Task& task)
+    {
+        TaskQueue& list = m_queues[index];
+
+        // peek without locking; idle workers poll this a lot
+        if (!list.count.load(std::memory_order_acquire))
+            return false;
+
+        SpinLockGuard guard(list.lock);
+
+        bool found = false;
+
+        for (size_t n = list.queues.size(); !found && n > 0; --n)
+        {
+            Queue* queue = list.queues.front();
+            list.queues.pop_front();
+
+            // only one worker at a time dequeues from a queue in the list, so the
+            // running count can't go past the limit between the check and the increment
+            if (queue->runnable() && queue->tasks->tasks.try_dequeue(task))
+            {
+                queue->waiting.fetch_sub(1);
+                found = true;
+
+                if (queue->limit.load())
+                {
+                    queue->running.fetch_add(1);
+                    task.limited = true;
+                }
+            }
+
+            if (queue->waiting.load() > 0 && queue->runnable())
+            {
+                if (found && --queue->deficit > 0)
+                {
+                    // the turn continues
+                    list.queues.push_front(queue);
+                }
+                else
+                {
+                    queue->deficit = queue->weight.load();
+                    list.queues.push_back(queue);
+                }
+            }
+            else
+            {
+                // drop out of the list until there is more work or a running task completes
+                queue->deficit = queue->weight.load();
+                queue->scheduled.store(false);
+
+                // take the queue back if an enqueue or a completion missed the flag
+                if (queue->waiting.load() > 0 && queue->runnable() && !queue->scheduled.exchange(true))
+                {
+                    list.queues.push_back(queue);
+                }
+            }
+        }
+
+        list.count_update();
+        return found;
+    }
+
+    bool ThreadPool::steal(size_t priority, Task& task)
+    {
+        const bool worker = g_worker_context.pool == this;
+        const size_t size = m_threads.size();
+
+        // start from the next worker so that thieves spread out over the victims
+        size_t victim = worker ? g_worker_context.index + 1 : 0;
+
+        // steal from workers on the same node first
+        const int passes = worker && m_node_count > 1 ? 2 : 1;
+
+        for (int pass = 0; pass < passes; ++pass)
+        {
+            for (size_t i = 0; i < size; ++i)
+            {
+                size_t index = (victim + i) % size;
+                if (worker && index == g_worker_context.index)
+                    continue;
+
+                if (passes > 1)
+                {
+                    bool local = m_worker_node[index] == m_worker_node[g_worker_context.index];
+                    if (local != (pass == 0))
+                        continue;
+                }
+
+                if (m_local_queues[index * 3 + priority].steal(task))
+                    return true;
+            }
+        }
+
+        return false;
+    }
+
+    void ThreadPool::process(Task& task)
+    {
+        Queue* queue = task.queue;
+
+        QueueCounters& counters = *queue->counters;
+
+        // check if the task is cancelled
+        if (!queue->cancel->isCancelled(task.stamp))
+        {
+            const bool timing = m_timing.load(std::memory_order_relaxed);
+            const u64 start = timing ? get_time_us() : 0;
+            counters.started.fetch_add(1, std::memory_order_relaxed);
+
+            // tasks enqueued before the timing was enabled have no timestamp
+            if (timing && task.time)
+            {
+                counters.latency.add(start - std::min(start, task.time));
+            }
+
+            // a thread helping in wait() can process tasks inside a task
+            CurrentTask previous = g_current_task;
+            g_current_task = { queue->cancel.get(), task.stamp };
+
+            // process task
+            ++g_task_depth;
+            {
+                MANGO_TRACE_SCOPE("thread", "task");
+                task.func();
+            }
+            --g_task_depth;
+
+            g_current_task = previous;
+
+            const u64 runtime = timing ? get_time_us() - start : 0;
+            if (timing)
+            {
+                counters.runtime.add(runtime);
+            }
+
+            counters.completed.fetch_add(1, std::memory_order_relaxed);
+
+            // nested tasks run inside the outer task's busy time
+            if (g_worker_context.pool == this && !g_task_depth)
+            {
+                WorkerCounters& worker = m_worker_counters[g_worker_context.index];
+                worker.increment(worker.tasks);
+                if (timing)
+                {
+                    worker.increment(worker.busy, runtime);
+                }
+            }
+        }
+        else
+        {
+            counters.cancelled.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        if (task.limited)
+        {
+            queue->running.fetch_sub(1);
+
+            // the queue can continue if it dropped out of the list at the limit
+            if (activate(queue))
+            {
+                wakeup(1);
+            }
+        }
+
+        int complete = queue->task_complete_count.fetch_add(1) + 1;
+        if (complete == queue->task_input_count.load())
+        {
+            // the queue was drained; release threads blocked in wait() and wait_for()
+            m_wait_event.notifyAll();
+            m_drain_event.notifyAll();
+        }
+    }
+
+    void ThreadPool::wait(Queue* queue)
+    {
+        // NOTE: we might be waiting here a while if other threads keep enqueuing tasks
+        while (!queue->empty())
+        {
+            // help with the work
+            if (dequeue_and_process())
+                continue;
+
+            // nothing to help with; the remaining tasks are already running
+            u32 key = m_wait_event.prepareWait();
+
+            if (queue->empty() || dequeue_and_process())
+            {
+                m_wait_event.cancelWait();
+                continue;
+            }
+
+            m_wait_event.commitWait(key);
+        }
+    }
+
+    bool ThreadPool::wait_for(Queue* queue, u32 milliseconds)
+    {
+        const u64 deadline = get_time_us() + u64(milliseconds) * 1000;
+
+        // NOTE: unlike wait() we don't help with the work; any task could run past the deadline
+        while (!queue->empty())
+        {
+            const u64 time = get_time_us();
+            if (time >= deadline)
+                return false;
+
+            u32 key = m_drain_event.prepareWait();
+
+            if (queue->empty())
+            {
+                m_drain_event.cancelWait();
+                break;
+            }
+
+            // round up so that we don't spin for the last fraction of a millisecond
+            m_drain_event.commitWait(key, u32((deadline - time + 999) / 1000));
+        }
+
+        return true;
+    }
+
+    void ThreadPool::cancel(Queue* queue)
+    {
+        queue->cancel->stamp_cancel = queue->task_input_count.load() - 1;
+    }
+
+    void ThreadPool::setDeadline(Queue* queue, u32 milliseconds)
+    {
+        queue->cancel->deadline = milliseconds ? get_time_us() + u64(milliseconds) * 1000 : 0;
+    }
+
+    bool ThreadPool::CancelState::isCancelled(int stamp) const
+    {
+        if (stamp <= stamp_cancel.load(std::memory_order_relaxed))
+            return true;
+
+        const u64 deadline = this->deadline.load(std::memory_order_relaxed);
+        return deadline && get_time_us() >= deadline;
+    }
+
+    ThreadPool::Queue* ThreadPool::createQueue(const std::string& name, int priority, int node)
+    {
+        Queue* queue = m_queue_cache.acquire();
+
+        queue->pool = this;
+        queue->priority = priority;
+        queue->node = node;
+        queue->task_input_count = 0;
+        queue->task_complete_count = 0;
+        // tokens from the previous use of the recycled queue keep the old state
+        if (queue->cancel && queue->cancel.use_count() == 1)
+        {
+            queue->cancel->stamp_cancel = -1;
+            queue->cancel->deadline = 0;
+        }
+        else
+        {
+            queue->cancel = std::make_shared<CancelState>();
+        }
+        queue->counters = getQueueCounters(name);
+        queue->waiting = 0;
+        queue->weight = 1;
+        queue->deficit = 1;
+        queue->limit = 0;
+        queue->running = 0;
+        queue->scheduled = false;
+
+        // the task store is kept with the recycled queue object
+        if (!queue->tasks)
+        {
+            queue->tasks = new QueueTasks();
+        }
+
+        return queue;
+    }
+
+    QueueCounters* ThreadPool::getQueueCounters(const std::string& name)
+    {
+        const size_t hash = std::hash<std::string>()(name);
+
+        // the queues are created often with a handful of names; find them without locking
+        for (size_t i = 0; i < COUNTERS_INDEX_PROBES; ++i)
+        {
+            QueueCounters* counters = m_counters_index[(hash + i) % COUNTERS_INDEX_SIZE].load(std::memory_order_acquire);
+            if (!counters)
+                break;
+
+            if (counters->name == name)
+                return counters;
+        }
+
+        std::lock_guard<std::mutex> lock(m_counters_mutex);
+
+        std::unique_ptr<QueueCounters>& counters = m_queue_counters[name];
+        if (!counters)
+        {
+            counters.reset(new QueueCounters());
+            counters->name = name;
+            counters->created = get_time_us();
+
+            // publish in the first free slot; names which don't fit are found in the map
+            for (size_t i = 0; i < COUNTERS_INDEX_PROBES; ++i)
+            {
+                std::atomic<QueueCounters*>& slot = m_counters_index[(hash + i) % COUNTERS_INDEX_SIZE];
+                if (!slot.load(std::memory_order_relaxed))
+                {
+                    slot.store(counters.get(), std::memory_order_release);
+                    break;
+                }
+            }
+        }
+
+        return counters.get();
+    }
+
+    void ThreadPool::deleteQueue(Queue* queue)
+    {
+        m_queue_cache.discard(queue);
+    }
+
+    // ------------------------------------------------------------
+    // ConcurrentQueue
+    // ------------------------------------------------------------
+
+    ConcurrentQueue::ConcurrentQueue()
+        : m_pool(ThreadPool::getInstance())
+    {
+        m_queue = m_pool.createQueue("concurrent.default", int(Priority::NORMAL));
+    }
+
+    ConcurrentQueue::ConcurrentQueue(const std::string& name, Priority priority, int node)
+        : m_pool(ThreadPool::getInstance())
+    {
+        m_queue = m_pool.createQueue(name, int(priority), node);
+    }
+
+    ConcurrentQueue::ConcurrentQueue(ThreadPool& pool, const std::string& name, Priority priority, int node)
+        : m_pool(pool)
+    {
+        m_queue = m_pool.createQueue(name, int(priority), node);
+    }
+
+    ConcurrentQueue::~ConcurrentQueue()
+    {
+        wait();
+        m_pool.deleteQueue(m_queue);
+    }
+
+    const std::string& ConcurrentQueue::name() const
+    {
+        return m_queue->counters->name;
+    }
+
+    Priority ConcurrentQueue::priority() const
+    {
+        return Priority(m_queue->priority);
+    }
+
+    int ConcurrentQueue::node() const
+    {
+        return m_queue->node;
+    }
+
+    void ConcurrentQueue::setWeight(int weight)
+    {
+        m_pool.configure(m_queue, weight, -1);
+    }
+
+    void ConcurrentQueue::setConcurrency(int limit)
+    {
+        m_pool.configure(m_queue, -1, limit);
+    }
+
+    void ConcurrentQueue::setDeadline(u32 milliseconds)
+    {
+        m_pool.setDeadline(m_queue, milliseconds);
+    }
+
+    void ConcurrentQueue::cancel()
+    {
+        m_pool.cancel(m_queue);
+    }
+
+    void ConcurrentQueue::wait()
+    {
+        m_pool.wait(m_queue);
+    }
+
+    bool ConcurrentQueue::wait_for(u32 milliseconds)
+    {
+        return m_pool.wait_for(m_queue, milliseconds);
+    }
+
+    // ------------------------------------------------------------
+    // CancellationToken
+    // ------------------------------------------------------------
+
+    CancellationToken CancellationToken::current()
+    {
+        const CurrentTask& task = g_current_task;
+        if (!task.state)
+            return CancellationToken();
+
+        return CancellationToken(task.state->shared_from_this(), task.stamp);
+    }
+
+    bool CancellationToken::isCancelled() const
+    {
+        return m_state && m_state->isCancelled(m_stamp);
+    }
+
+    // ------------------------------------------------------------
+    // TaskGraph
+    // ------------------------------------------------------------
+
+    struct TaskGraphNode
+    {
+        TaskFunction func;
+
+        // predecessors which have not completed yet, plus one while the node is being submitted
+        std::atomic<int> pending { 1 };
+
+        SpinLock lock;
+        bool complete { false };
+        std::vector<TaskGraphNode*> successors;
+    };
+
+    TaskGraph::TaskGraph()
+        : m_queue("graph.default", Priority::NORMAL)
+    {
+    }
+
+    TaskGraph::TaskGraph(const std::string& name, Priority priority)
+        : m_queue(name, priority)
+    {
+    }
+
+    TaskGraph::TaskGraph(ThreadPool& pool, const std::string& name, Priority priority)
+        : m_queue(pool, name, priority)
+    {
+    }
+
+    TaskGraph::~TaskGraph()
+    {
+        // NOTE: the exceptions are only reported by an explicit wait()
+        m_queue.wait();
+
+        for (Node node : m_nodes)
+        {
+            delete node;
+        }
+    }
+
+    TaskGraph::Node TaskGraph::createNode(TaskFunction&& func)
+    {
+        Node node = new TaskGraphNode();
+        node->func = std::move(func);
+
+        SpinLockGuard guard(m_lock);
+        m_nodes.push_back(node);
+
+        return node;
+    }
+
+    void TaskGraph::submit(Node node, const std::vector<Node>& predecessors)
+    {
+        for (Node predecessor : predecessors)
+        {
+            if (!predecessor)
+                continue;
+
+            SpinLockGuard guard(predecessor->lock);
+            if (!predecessor->complete)
+            {
+                // the predecessor will release us when it completes
+                node->pending.fetch_add(1, std::memory_order_relaxed);
+                predecessor->successors.push_back(node);
+            }
+        }
+
+        // release the submission reference
+        if (node->pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            schedule(node);
+        }
+    }
+
+    void TaskGraph::schedule(Node node)
+    {
+        if (m_cancelled.load(std::memory_order_relaxed))
+            return;
+
+        m_queue.enqueue([this, node] {
+            execute(node);
+        });
+    }
+
+    void TaskGraph::execute(Node node)
+    {
+        try
+        {
+            node->func();
+        }
+        catch (...)
+        {
+            // the pool can't propagate exceptions; keep the first one for wait()
+            {
+                SpinLockGuard guard(m_lock);
+                if (!m_exception)
+                {
+                    m_exception = std::current_exception();
+                }
+            }
+
+            cancel();
+        }
+
+        // release the captured state; the node itself is referenced until the graph is destroyed
+        node->func = TaskFunction();
+
+        std::vector<Node> successors;
+
+        {
+            SpinLockGuard guard(node->lock);
+            node->complete = true;
+            successors.swap(node->successors);
+        }
+
+        // the successors are enqueued before this task is counted as complete,
+        // so the queue cannot drain while there is work left in the graph
+        for (Node successor : successors)
+        {
+            if (successor->pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                schedule(successor);
+            }
+        }
+    }
+
+    void TaskGraph::cancel()
+    {
+        // tasks which have not started are dropped together with all tasks depending on them
+        m_cancelled = true;
+        m_queue.cancel();
+    }
+
+    void TaskGraph::wait()
+    {
+        m_queue.wait();
+
+        std::exception_ptr exception;
+
+        {
+            SpinLockGuard guard(m_lock);
+            exception = m_exception;
+            m_exception = nullptr;
+        }
+
+        // nothing is in flight; the following tasks are scheduled again
+        m_cancelled = false;
+
+        if (exception)
+        {
+            std::rethrow_exception(exception);
+        }
+    }
+
+    // ------------------------------------------------------------
+    // SerialQueue
+    // ------------------------------------------------------------
+
+    struct SerialTaskNode
+    {
+        std::atomic<SerialTaskNode*> next { nullptr };
+        int stamp { 0 };
+        TaskFunction func;
+    };
+
+    static SerialTaskNode* createSerialTaskNode()
+    {
+        void* address = detail::allocateTaskStorage(sizeof(SerialTaskNode), alignof(SerialTaskNode));
+        return new (address) SerialTaskNode();
+    }
+
+    static void deleteSerialTaskNode(SerialTaskNode* node)
+    {
+        node->~SerialTaskNode();
+        detail::freeTaskStorage(node, sizeof(SerialTaskNode), alignof(SerialTaskNode));
+    }
+
+    SerialQueue::SerialQueue()
+        : m_pool(ThreadPool::getInstance())
+    {
+        initialize("serial.default");
+    }
+
+    SerialQueue::SerialQueue(const std::string& name)
+        : m_pool(ThreadPool::getInstance())
+    {
+        initialize(name);
+    }
+
+    SerialQueue::SerialQueue(ThreadPool& pool, const std::string& name)
+        : m_pool(pool)
+    {
+        initialize(name);
+    }
+
+    SerialQueue::~SerialQueue()
+    {
+        wait();
+
+        // only the stub node is left
+        deleteSerialTaskNode(m_tail);
+        m_pool.deleteQueue(m_queue);
+    }
+
+    void SerialQueue::initialize(const std::string& name)
+    {
+        m_queue = m_pool.createQueue(name, int(Priority::NORMAL));
+
+        SerialTaskNode* stub = createSerialTaskNode();
+        m_head = stub;
+        m_tail = stub;
+    }
+
+    void SerialQueue::push(TaskFunction&& func)
+    {
+        SerialTaskNode* node = createSerialTaskNode();
+        node->stamp = m_task_input++;
+        node->func = std::move(func);
+
+        SerialTaskNode* prev = m_head.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+
+        // the first pending task schedules the queue; otherwise it is already running
+        if (!m_task_counter.fetch_add(1, std::memory_order_acq_rel))
+        {
+            m_pool.enqueue(m_queue, [this] {
+                drain();
+            });
+        }
+    }
+
+    void SerialQueue::drain()
+    {
+        // run a batch of tasks and then give the worker back to the pool so that
+        // a busy serial queue does not monopolize it
+        const int batch = 64;
+
+        for (int i = 0; i < batch; ++i)
+        {
+            SerialTaskNode* tail = m_tail;
+            SerialTaskNode* next = tail->next.load(std::memory_order_acquire);
+
+            while (!next)
+            {
+                // the task has been counted but the producer has not linked it yet
+                cpu_pause();
+                next = tail->next.load(std::memory_order_acquire);
+            }
+
+            // the next node becomes the new stub
+            m_tail = next;
+            deleteSerialTaskNode(tail);
+
+            TaskFunction func = std::move(next->func);
+            if (next->stamp > m_stamp_cancel.load(std::memory_order_relaxed))
+            {
+                func();
+            }
+
+            if (m_task_counter.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                // drained; the next enqueue schedules the queue again
+                return;
+            }
+        }
+
+        m_pool.enqueue(m_queue, [this] {
+            drain();
+        });
+    }
+
+    void SerialQueue::cancel()
+    {
+        // skip the tasks which have not started yet
+        m_stamp_cancel = m_task_input.load() - 1;
+    }
+
+    void SerialQueue::wait()
+    {
+        while (m_task_counter.load())
+        {
+            // help the pool until the scheduled tasks have completed
+            m_pool.wait(m_queue);
+
+            if (m_task_counter.load())
+            {
+                // a task is being enqueued right now
+                std::this_thread::yield();
+            }
         }
     }
 
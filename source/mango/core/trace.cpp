@@ -0,0 +1,257 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2019 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <mango/core/trace.hpp>
+#include <mango/core/exception.hpp>
+
+namespace
+{
+    using namespace mango;
+
+    struct TraceEvent
+    {
+        const char* category;
+        const char* name;
+        u64 time;
+        u64 duration;
+    };
+
+    /*
+        Every thread which records events owns one TraceBuffer. The owner is the only
+        writer, so appending an event is a store and a release of the head; when the
+        buffer is full the oldest events are overwritten. The owner marks the buffer
+        while it is writing so that stopTrace() can wait for the event in flight, and
+        discards the events of a previous recording itself when it sees a new epoch.
+    */
+
+    struct TraceBuffer
+    {
+        enum { SIZE = 1 << 14 };
+
+        TraceEvent events[SIZE];
+        std::atomic<u64> head { 0 };
+        std::atomic<bool> writing { false };
+        std::string name;
+        int id;
+
+        // written by the owner while writing; read by stopTrace() when it is not
+        u32 epoch { 0 }; // recording the events since begin belong to
+        u64 begin { 0 };
+
+        void push(u32 current, const char* category, const char* name, u64 time, u64 duration)
+        {
+            u64 index = head.load(std::memory_order_relaxed);
+            if (epoch != current)
+            {
+                epoch = current;
+                begin = index;
+            }
+
+            TraceEvent& event = events[index & (SIZE - 1)];
+            event.category = category;
+            event.name = name;
+            event.time = time;
+            event.duration = duration;
+            head.store(index + 1, std::memory_order_release);
+        }
+    };
+
+    u64 getSteadyTime()
+    {
+        auto time = std::chrono::steady_clock::now().time_since_epoch();
+        return u64(std::chrono::duration_cast<std::chrono::microseconds>(time).count());
+    }
+
+    struct TraceState
+    {
+        std::atomic<bool> recording { false };
+        std::atomic<u32> epoch { 0 };
+        std::atomic<u64> start { getSteadyTime() }; // microseconds
+
+        std::mutex mutex;
+        std::vector<TraceBuffer*> buffers; // NOTE: never released; threads can exit during recording
+    };
+
+    TraceState& getTraceState()
+    {
+        // NOTE: intentionally leaked; worker threads can record after static destructors
+        static TraceState* state = new TraceState();
+        return *state;
+    }
+
+    thread_local TraceBuffer* g_trace_buffer = nullptr;
+    thread_local std::string g_trace_thread_name;
+
+    TraceBuffer* getTraceBuffer()
+    {
+        if (!g_trace_buffer)
+        {
+            TraceState& state = getTraceState();
+            std::lock_guard<std::mutex> lock(state.mutex);
+
+            TraceBuffer* buffer = new TraceBuffer();
+            buffer->id = int(state.buffers.size()) + 1;
+            buffer->name = g_trace_thread_name.empty() ? "thread " + std::to_string(buffer->id) : g_trace_thread_name;
+            state.buffers.push_back(buffer);
+
+            g_trace_buffer = buffer;
+        }
+
+        return g_trace_buffer;
+    }
+
+    void writeString(std::FILE* file, const char* text)
+    {
+        std::fputc('"', file);
+
+        for ( ; *text; ++text)
+        {
+            char c = *text;
+            if (c == '"' || c == '\\')
+            {
+                std::fputc('\\', file);
+                std::fputc(c, file);
+            }
+            else if (u8(c) < 0x20)
+            {
+                std::fprintf(file, "\\u%04x", c);
+            }
+            else
+            {
+                std::fputc(c, file);
+            }
+        }
+
+        std::fputc('"', file);
+    }
+
+} // namespace
+
+namespace mango
+{
+
+    void startTrace()
+    {
+        TraceState& state = getTraceState();
+        std::lock_guard<std::mutex> lock(state.mutex);
+
+        // the buffers are not reset here as their owners may be writing; the owner
+        // starts a new range when it records the first event in the new epoch
+        state.epoch.fetch_add(1);
+        state.start = getSteadyTime();
+        state.recording = true;
+    }
+
+    void stopTrace(const std::string& filename)
+    {
+        TraceState& state = getTraceState();
+        state.recording = false;
+
+        std::lock_guard<std::mutex> lock(state.mutex);
+
+        // wait for the events in flight; later events see that the recording has stopped
+        for (TraceBuffer* buffer : state.buffers)
+        {
+            while (buffer->writing.load())
+            {
+                std::this_thread::yield();
+            }
+        }
+
+        const u32 epoch = state.epoch.load();
+
+        std::FILE* file = std::fopen(filename.c_str(), "wb");
+        if (!file)
+        {
+            MANGO_EXCEPTION("[Trace] Cannot create file \"%s\".", filename.c_str());
+        }
+
+        std::fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+        bool first = true;
+
+        for (TraceBuffer* buffer : state.buffers)
+        {
+            // the buffer has no events in this recording
+            if (buffer->epoch != epoch)
+                continue;
+
+            const u64 head = buffer->head.load(std::memory_order_acquire);
+            const u64 tail = std::max(buffer->begin, head > TraceBuffer::SIZE ? head - TraceBuffer::SIZE : 0);
+
+            if (head == tail)
+                continue;
+
+            std::fprintf(file, "%s{\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"name\":\"thread_name\",\"args\":{\"name\":",
+                first ? "" : ",\n", buffer->id);
+            writeString(file, buffer->name.c_str());
+            std::fprintf(file, "}}");
+            first = false;
+
+            for (u64 i = tail; i < head; ++i)
+            {
+                const TraceEvent& event = buffer->events[i & (TraceBuffer::SIZE - 1)];
+
+                std::fprintf(file, ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%llu,\"dur\":%llu,\"cat\":",
+                    buffer->id, (unsigned long long)event.time, (unsigned long long)event.duration);
+                writeString(file, event.category);
+                std::fprintf(file, ",\"name\":");
+                writeString(file, event.name);
+                std::fprintf(file, "}");
+            }
+        }
+
+        std::fprintf(file, "\n]}\n");
+        std::fclose(file);
+    }
+
+    bool isTraceRecording()
+    {
+        return getTraceState().recording.load(std::memory_order_relaxed);
+    }
+
+    void setTraceThreadName(const std::string& name)
+    {
+        g_trace_thread_name = name;
+
+        if (g_trace_buffer)
+        {
+            TraceState& state = getTraceState();
+            std::lock_guard<std::mutex> lock(state.mutex);
+            g_trace_buffer->name = name;
+        }
+    }
+
+    u64 getTraceTime()
+    {
+        return getSteadyTime() - getTraceState().start.load(std::memory_order_relaxed);
+    }
+
+    void recordTraceEvent(const char* category, const char* name, u64 time, u64 duration)
+    {
+        // the scope might have started before the recording was stopped
+        if (!isTraceRecording())
+            return;
+
+        TraceBuffer* buffer = getTraceBuffer();
+        TraceState& state = getTraceState();
+
+        // stopTrace() clears the recording before it waits for the writing flags,
+        // so either we see it stopped or it sees us writing (both are seq_cst)
+        buffer->writing.store(true);
+        if (state.recording.load())
+        {
+            buffer->push(state.epoch.load(std::memory_order_relaxed), category, name, time, duration);
+        }
+        buffer->writing.store(false, std::memory_order_release);
+    }
+
+} // namespace mango
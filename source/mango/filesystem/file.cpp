@@ -67,6 +67,32 @@ namespace filesystem {
         }
     }
 
+    File::File(const Path& path, const std::string& s, u64 offset, u64 size)
+    {
+        // split s into pathname + filename
+        size_t n = s.find_last_of("/\\:");
+        std::string filename = s.substr(n + 1);
+        std::string filepath = s.substr(0, n + 1);
+
+        m_filename = filename;
+
+        // create a internal path
+        m_path.reset(new Path(path, filepath));
+
+        Mapper* path_mapper = m_path->m_mapper.get();
+        if (!path_mapper)
+        {
+            MANGO_EXCEPTION(ID"Mapper interface missing.");
+        }
+
+        AbstractMapper* mapper = *path_mapper;
+        if (mapper)
+        {
+            VirtualMemory* vmemory = mapper->mmapRange(path_mapper->basepath() + m_filename, offset, size);
+            m_memory = UniqueObject<VirtualMemory>(vmemory);
+        }
+    }
+
     File::File(const Memory& memory, const std::string& extension, const std::string& filename)
     {
         std::string password;
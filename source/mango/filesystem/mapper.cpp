@@ -11,6 +11,26 @@
 namespace mango {
 namespace filesystem {
 
+    // -----------------------------------------------------------------
+    // VirtualMemoryRange
+    // -----------------------------------------------------------------
+
+    class VirtualMemoryRange : public mango::VirtualMemory
+    {
+    protected:
+        std::unique_ptr<VirtualMemory> m_parent;
+
+    public:
+        VirtualMemoryRange(VirtualMemory* parent, u64 offset, u64 size)
+            : m_parent(parent)
+        {
+            Memory memory = *m_parent;
+            offset = std::min(offset, u64(memory.size));
+            size = std::min(size, memory.size - offset);
+            m_memory = Memory(memory.address + offset, size_t(size));
+        }
+    };
+
     // -----------------------------------------------------------------
     // extension registry
     // -----------------------------------------------------------------
@@ -120,6 +140,15 @@ namespace filesystem {
         }
     }
 
+    // -----------------------------------------------------------------
+    // AbstractMapper
+    // -----------------------------------------------------------------
+
+    VirtualMemory* AbstractMapper::mmapRange(const std::string& filename, u64 offset, u64 size)
+    {
+        return new VirtualMemoryRange(mmap(filename), offset, size);
+    }
+
     // -----------------------------------------------------------------
     // Mapper
     // -----------------------------------------------------------------
@@ -2,6 +2,10 @@
     MANGO Multimedia Development Platform
     Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
 */
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 #include <mango/core/core.hpp>
 #include <mango/filesystem/filesystem.hpp>
 #include <mango/image/fourcc.hpp>
@@ -17,6 +21,7 @@ namespace
     using mango::filesystem::Indexer;
 
     constexpr u64 mgx_header_size = 24;
+    constexpr size_t mgx_block_cache_size = 64 * 1024 * 1024;
 
     struct Block
     {
@@ -206,6 +211,100 @@ namespace filesystem {
         }
     };
 
+    // -----------------------------------------------------------------
+    // BlockCache
+    // -----------------------------------------------------------------
+
+    /*
+        Small files are packed into shared compressed blocks. The decompressed
+        blocks are kept in a LRU cache, so that mapping a small file is an offset
+        into a cached block. The mapped files hold a reference to the block, which
+        keeps it alive after it has been evicted from the cache.
+    */
+
+    using CachedBlock = std::shared_ptr<Buffer>;
+
+    class BlockCache : protected NonCopyable
+    {
+    protected:
+        struct Entry
+        {
+            CachedBlock block;
+            std::list<u32>::iterator lru;
+        };
+
+        std::mutex m_mutex;
+        std::unordered_map<u32, Entry> m_blocks;
+        std::list<u32> m_lru; // most recently used first
+        size_t m_capacity;
+        size_t m_size;
+
+    public:
+        BlockCache(size_t capacity)
+            : m_capacity(capacity)
+            , m_size(0)
+        {
+        }
+
+        CachedBlock get(u32 index)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            auto i = m_blocks.find(index);
+            if (i == m_blocks.end())
+                return nullptr;
+
+            m_lru.splice(m_lru.begin(), m_lru, i->second.lru);
+            return i->second.block;
+        }
+
+        CachedBlock insert(u32 index, CachedBlock block)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            auto i = m_blocks.find(index);
+            if (i != m_blocks.end())
+            {
+                // another thread decompressed the same block
+                m_lru.splice(m_lru.begin(), m_lru, i->second.lru);
+                return i->second.block;
+            }
+
+            const size_t size = block->size();
+
+            while (!m_lru.empty() && m_size + size > m_capacity)
+            {
+                auto j = m_blocks.find(m_lru.back());
+                m_size -= j->second.block->size();
+                m_blocks.erase(j);
+                m_lru.pop_back();
+            }
+
+            m_lru.push_front(index);
+            m_blocks[index] = { block, m_lru.begin() };
+            m_size += size;
+
+            return block;
+        }
+    };
+
+    // -----------------------------------------------------------------
+    // VirtualMemoryBlockMGX
+    // -----------------------------------------------------------------
+
+    class VirtualMemoryBlockMGX : public mango::VirtualMemory
+    {
+    protected:
+        CachedBlock m_block;
+
+    public:
+        VirtualMemoryBlockMGX(CachedBlock block, size_t offset, size_t size)
+            : m_block(block)
+        {
+            m_memory = Memory(m_block->data() + offset, size);
+        }
+    };
+
     // -----------------------------------------------------------------
     // MapperMGX
     // -----------------------------------------------------------------
@@ -215,14 +314,40 @@ namespace filesystem {
     public:
         HeaderMGX m_header;
         std::string m_password;
+        BlockCache m_cache;
 
     public:
         MapperMGX(Memory parent, const std::string& password)
             : m_header(parent)
             , m_password(password)
+            , m_cache(mgx_block_cache_size)
         {
         }
 
+        CachedBlock getBlock(u32 index)
+        {
+            CachedBlock block = m_cache.get(index);
+            if (!block)
+            {
+                const Block& header = m_header.m_blocks[index];
+
+                if (header.offset + header.compressed > m_header.m_memory.size)
+                {
+                    MANGO_EXCEPTION(ID"Block %d is outside of parent memory.", index);
+                }
+
+                block = std::make_shared<Buffer>(size_t(header.uncompressed));
+
+                Compressor compressor = getCompressor(Compressor::Method(header.method));
+                Memory src(m_header.m_memory.address + header.offset, size_t(header.compressed));
+                compressor.decompress(*block, src);
+
+                block = m_cache.insert(index, block);
+            }
+
+            return block;
+        }
+
         bool isFile(const std::string& filename) const override
         {
             const FileHeader* ptrHeader = m_header.m_folders.getHeader(filename);
@@ -280,19 +405,18 @@ namespace filesystem {
 
                 if (file.isCompressed())
                 {
-                    if (segment.size != block.uncompressed && !file.isMultiSegment())
+                    if (segment.size != block.uncompressed && block.uncompressed <= mgx_block_cache_size / 4)
                     {
-                        // a small file stored in one block with other small files
-                        // cache the decompressed buffers
-
-                        // TODO: decompression cache for small-file blocks
-#if 0
-                        // simulate almost-zero-cost (AZC) decompression
-                        u8* ptr = new u8[file.size];
-                        std::memset(ptr, 0, file.size);
-                        VirtualMemoryMGX* vm = new VirtualMemoryMGX(ptr, ptr, file.size);
+                        // a small file stored in one block with other small files;
+                        // map it from the cached decompressed block
+                        if (segment.offset + file.size > block.uncompressed)
+                        {
+                            MANGO_EXCEPTION(ID"File \"%s\" is outside of the block.", filename.c_str());
+                        }
+
+                        CachedBlock cached = getBlock(segment.block);
+                        VirtualMemoryBlockMGX* vm = new VirtualMemoryBlockMGX(cached, segment.offset, size_t(file.size));
                         return vm;
-#endif
                     }
                 }
                 else
@@ -2,14 +2,23 @@
     MANGO Multimedia Development Platform
     Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
 */
+#include <algorithm>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <mango/core/pointer.hpp>
 #include <mango/core/string.hpp>
 #include <mango/core/exception.hpp>
+#include <mango/core/aes.hpp>
+#include <mango/core/hash.hpp>
 #include <mango/core/compress.hpp>
+#include <mango/core/trace.hpp>
 #include <mango/filesystem/mapper.hpp>
 #include <mango/filesystem/path.hpp>
 #include "indexer.hpp"
 
+// only the tinfl state machine is used; keep the zlib names out of the way
+#define MINIZ_NO_ZLIB_COMPATIBLE_NAMES
 #include "../../external/miniz/miniz.h"
 
 #define ID "[mapper.zip] "
@@ -488,52 +497,303 @@ namespace
 		return true;
 	}
 
-	u64 zip_decompress(u8* compressed, u8* uncompressed, u64 compressedLen, u64 uncompressedLen)
-	{
-		z_stream zstream;
-		std::memset(&zstream, 0, sizeof(zstream));
+    // --------------------------------------------------------------------
+    // WinZip AES
+    // --------------------------------------------------------------------
 
-		zstream.next_in  = compressed;
-		zstream.avail_in = uInt(compressedLen); // TODO: upgrade to support 64 bit files
+    enum
+    {
+        AES_PWVERIFYSIZE = 2,
+        AES_AUTHCODESIZE = 10,
+        AES_ITERATIONS = 1000,
+    };
 
-        if (inflateInit2(&zstream, -MAX_WBITS) != Z_OK)
-		{
-            MANGO_EXCEPTION(ID"InflateInit failed.");
-		}
+    struct HMAC_SHA1
+    {
+        SHA1 inner;
+        SHA1 outer;
 
-    	// decompression
-		zstream.next_out  = uncompressed;
-	    zstream.avail_out = uInt(uncompressedLen); // TODO: upgrade to support 64 bit files
+        HMAC_SHA1(const u8* key, size_t length)
+        {
+            u8 block[64] = { 0 };
 
-    	int zcode = inflate(&zstream, Z_FINISH);
-		if (zcode != Z_STREAM_END)
+            if (length > 64)
+            {
+                // long keys are replaced with their hash
+                u32 hash[5];
+                sha1(hash, Memory(const_cast<u8*>(key), length));
+                std::memcpy(block, hash, 20);
+            }
+            else if (length)
+            {
+                std::memcpy(block, key, length);
+            }
+
+            u8 pad[64];
+
+            for (int i = 0; i < 64; ++i)
+                pad[i] = block[i] ^ 0x36;
+            inner.update(Memory(pad, 64));
+
+            for (int i = 0; i < 64; ++i)
+                pad[i] = block[i] ^ 0x5c;
+            outer.update(Memory(pad, 64));
+        }
+
+        void update(const u8* data, size_t size)
         {
-            const char* msg = ID"Internal error.";
-            switch (zcode)
+            inner.update(Memory(const_cast<u8*>(data), size));
+        }
+
+        void final(u8 mac[20])
+        {
+            u32 hash[5];
+            inner.final(hash);
+            outer.update(Memory(reinterpret_cast<u8*>(hash), 20));
+            outer.final(hash);
+            std::memcpy(mac, hash, 20);
+        }
+    };
+
+    void pbkdf2_hmac_sha1(u8* output, size_t length, const std::string& password, const u8* salt, size_t salt_length, int iterations)
+    {
+        // the padded key states are computed once and copied for each round
+        const HMAC_SHA1 prf(reinterpret_cast<const u8*>(password.data()), password.length());
+
+        for (u32 index = 1; length > 0; ++index)
+        {
+            u8 count[4];
+            ustore32be(count, index);
+
+            HMAC_SHA1 hmac = prf;
+            hmac.update(salt, salt_length);
+            hmac.update(count, 4);
+
+            u8 u[20];
+            hmac.final(u);
+
+            u8 t[20];
+            std::memcpy(t, u, 20);
+
+            for (int i = 1; i < iterations; ++i)
             {
-                case Z_MEM_ERROR:
-                    msg = ID"Memory error.";
-                    break;
+                hmac = prf;
+                hmac.update(u, 20);
+                hmac.final(u);
 
-                case Z_BUF_ERROR:
-                    msg = ID"Buffer error.";
-                    break;
+                for (int j = 0; j < 20; ++j)
+                {
+                    t[j] ^= u[j];
+                }
+            }
 
-                case Z_DATA_ERROR:
-                    msg = ID"Data error.";
-                    break;
+            const size_t bytes = std::min(length, size_t(20));
+            std::memcpy(output, t, bytes);
+            output += bytes;
+            length -= bytes;
+        }
+    }
+
+    class ZipDecrypterAES
+    {
+    protected:
+        std::unique_ptr<AES> m_aes;
+        HMAC_SHA1 m_hmac;
+        u8 m_passverify[AES_PWVERIFYSIZE];
+
+        struct KeyMaterial
+        {
+            // encryption key, authentication key and password verification value
+            u8 data[32 + 32 + AES_PWVERIFYSIZE];
+
+            KeyMaterial(int bits, const u8* salt, const std::string& password)
+            {
+                const size_t keylen = bits / 8;
+                pbkdf2_hmac_sha1(data, keylen * 2 + AES_PWVERIFYSIZE, password, salt, keylen / 2, AES_ITERATIONS);
             }
-            MANGO_EXCEPTION(msg);
+        };
+
+        ZipDecrypterAES(int bits, const KeyMaterial& key)
+            : m_aes(new AES(key.data, bits))
+            , m_hmac(key.data + bits / 8, bits / 8)
+        {
+            std::memcpy(m_passverify, key.data + bits / 4, AES_PWVERIFYSIZE);
         }
 
-		if (inflateEnd(&zstream) != Z_OK)
-	    {
-            MANGO_EXCEPTION(ID"Inflate failed.");
-		}
+    public:
+        ZipDecrypterAES(int bits, const u8* salt, const std::string& password)
+            : ZipDecrypterAES(bits, KeyMaterial(bits, salt, password))
+        {
+        }
+
+        bool verify(const u8* passverify) const
+        {
+            return !std::memcmp(m_passverify, passverify, AES_PWVERIFYSIZE);
+        }
+
+        bool decrypt(u8* out, const u8* in, size_t size, const u8* authcode)
+        {
+            // the counter is a little-endian 128 bit integer starting from one
+            constexpr size_t chunk_size = 16 * 1024;
+            u8 keystream[chunk_size];
+            u64 counter = 1;
+
+            for (size_t offset = 0; offset < size; offset += chunk_size)
+            {
+                const size_t bytes = std::min(chunk_size, size - offset);
+                const size_t blocks = (bytes + 15) / 16;
+
+                // authenticate the ciphertext while it is in the cache
+                m_hmac.update(in + offset, bytes);
+
+                for (size_t i = 0; i < blocks; ++i)
+                {
+                    ustore64le(keystream + i * 16 + 0, counter++);
+                    ustore64le(keystream + i * 16 + 8, 0);
+                }
+
+                m_aes->ecb_block_encrypt(keystream, keystream, blocks * 16);
+
+                for (size_t i = 0; i < bytes; ++i)
+                {
+                    out[offset + i] = in[offset + i] ^ keystream[i];
+                }
+            }
+
+            u8 mac[20];
+            m_hmac.final(mac);
+
+            return !std::memcmp(mac, authcode, AES_AUTHCODESIZE);
+        }
+    };
+
+    int getKeyBits(Encryption encryption)
+    {
+        return getSaltLength(encryption) * 16;
+    }
 
-		return zstream.total_out;
+	u64 zip_decompress(u8* compressed, u8* uncompressed, u64 compressedLen, u64 uncompressedLen)
+	{
+        Memory dest(uncompressed, size_t(uncompressedLen));
+        Memory source(compressed, size_t(compressedLen));
+        return deflate::decompress(dest, source);
     }
 
+    // -----------------------------------------------------------------
+    // InflateIndex
+    // -----------------------------------------------------------------
+
+    /*
+        InflateIndex decodes ranges of a deflate stream. The decoder state and the
+        32 KB window are saved every inflate_checkpoint_interval bytes of output, so that
+        decoding a range resumes from the closest checkpoint before it instead of
+        the beginning of the stream. The checkpoints are recorded as the stream is
+        decoded further, so reading only the beginning of a file is cheap. The start
+        of the stream needs no checkpoint; ranges before the first checkpoint are
+        decoded from a freshly initialized state.
+    */
+
+    constexpr u64 inflate_checkpoint_interval = 1024 * 1024;
+    constexpr size_t inflate_index_cache_size = 16; // indices kept by the mapper
+
+    class InflateIndex : protected NonCopyable
+    {
+    protected:
+        struct Checkpoint
+        {
+            tinfl_decompressor state;
+            u8 window[TINFL_LZ_DICT_SIZE];
+            size_t input;
+            u64 output;
+        };
+
+        Memory m_input;
+        u64 m_size;
+
+        std::mutex m_mutex;
+        std::vector<std::unique_ptr<Checkpoint>> m_checkpoints; // [i] is at (i + 1) * interval
+
+    public:
+        InflateIndex(Memory input, u64 size)
+            : m_input(input)
+            , m_size(size)
+        {
+        }
+
+        void decode(u8* dest, u64 offset, u64 size)
+        {
+            const u64 end = offset + size;
+
+            Checkpoint cp;
+
+            // resume from the last checkpoint before the range
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+
+                size_t index = size_t(std::min(offset / inflate_checkpoint_interval, u64(m_checkpoints.size())));
+                if (index)
+                {
+                    cp = *m_checkpoints[index - 1];
+                }
+                else
+                {
+                    tinfl_init(&cp.state);
+                    cp.input = 0;
+                    cp.output = 0;
+                }
+            }
+
+            size_t window = 0;
+
+            while (cp.output < end)
+            {
+                size_t in_bytes = m_input.size - cp.input;
+                size_t out_bytes = TINFL_LZ_DICT_SIZE - window;
+
+                tinfl_status status = tinfl_decompress(&cp.state, m_input.address + cp.input, &in_bytes,
+                    cp.window, cp.window + window, &out_bytes, 0);
+
+                cp.input += in_bytes;
+
+                // copy the decoded bytes which are inside the range
+                const u64 first = std::max(cp.output, offset);
+                const u64 last = std::min(cp.output + out_bytes, end);
+                if (first < last)
+                {
+                    std::memcpy(dest + (first - offset), cp.window + window + (first - cp.output), size_t(last - first));
+                }
+
+                cp.output += out_bytes;
+                window = (window + out_bytes) & (TINFL_LZ_DICT_SIZE - 1);
+
+                if (status < TINFL_STATUS_DONE)
+                {
+                    MANGO_EXCEPTION(ID"Data error.");
+                }
+
+                if (status == TINFL_STATUS_DONE)
+                {
+                    if (cp.output < end)
+                    {
+                        MANGO_EXCEPTION(ID"Incorrect decompressed size.");
+                    }
+                    break;
+                }
+
+                // the window is full at this point, so the state can be saved as-is
+                if (!window && cp.output % inflate_checkpoint_interval == 0)
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+
+                    if (cp.output / inflate_checkpoint_interval == m_checkpoints.size() + 1)
+                    {
+                        m_checkpoints.emplace_back(new Checkpoint(cp));
+                    }
+                }
+            }
+        }
+    };
+
 } // namespace
 
 namespace mango {
@@ -572,6 +832,10 @@ namespace filesystem {
         std::string m_password;
         Indexer<FileHeader> m_folders;
 
+        // recently used inflate indices, most recently used first
+        std::mutex m_inflate_mutex;
+        std::list<std::pair<const FileHeader*, std::shared_ptr<InflateIndex>>> m_inflate_indices;
+
         MapperZIP(Memory parent, const std::string& password)
             : m_parent_memory(parent)
             , m_password(password)
@@ -611,7 +875,7 @@ namespace filesystem {
         {
         }
 
-        VirtualMemory* mmap(const FileHeader& header, u8* start, const std::string& password)
+        u8* getFileAddress(const FileHeader& header, u8* start) const
         {
             LittleEndianPointer p = start + header.localOffset;
 
@@ -622,11 +886,42 @@ namespace filesystem {
             }
 
             u64 offset = header.localOffset + 30 + localHeader.filenameLen + localHeader.extraFieldLen;
+            return start + offset;
+        }
+
+        std::shared_ptr<InflateIndex> getInflateIndex(const FileHeader& header)
+        {
+            std::lock_guard<std::mutex> lock(m_inflate_mutex);
+
+            for (auto i = m_inflate_indices.begin(); i != m_inflate_indices.end(); ++i)
+            {
+                if (i->first == &header)
+                {
+                    m_inflate_indices.splice(m_inflate_indices.begin(), m_inflate_indices, i);
+                    return i->second;
+                }
+            }
 
-            u8* address = start + offset;
+            if (m_inflate_indices.size() >= inflate_index_cache_size)
+            {
+                // the index is shared with the decoders which are still using it
+                m_inflate_indices.pop_back();
+            }
+
+            Memory input(getFileAddress(header, m_parent_memory.address), size_t(header.compressedSize));
+            std::shared_ptr<InflateIndex> index = std::make_shared<InflateIndex>(input, header.uncompressedSize);
+            m_inflate_indices.emplace_front(&header, index);
+
+            return index;
+        }
+
+        VirtualMemory* mmap(const FileHeader& header, u8* start, const std::string& password)
+        {
+            u8* address = getFileAddress(header, start);
             u64 size = 0;
 
             u8* buffer = nullptr; // remember allocated memory
+            u64 compressed_size = header.compressedSize; // without the encryption header
 
             //printf("[ZIP] compression: %d, encryption: %d \n", header.compression, header.encryption);
 
@@ -640,12 +935,12 @@ namespace filesystem {
                     // decryption header
                     u8* dcheader = address;
                     address += DCKEYSIZE;
+                    compressed_size -= DCKEYSIZE;
 
                     // NOTE: decryption capability reduced on 32 bit platforms
-                    const size_t compressed_size = size_t(header.compressedSize);
-                    buffer = new u8[compressed_size];
+                    buffer = new u8[size_t(compressed_size)];
 
-                    bool status = zip_decrypt(buffer, address, header.compressedSize, dcheader,
+                    bool status = zip_decrypt(buffer, address, compressed_size, dcheader,
                                             header.versionUsed & 0xff, header.crc, password);
                     if (!status)
                     {
@@ -661,30 +956,43 @@ namespace filesystem {
                 case ENCRYPTION_AES192:
                 case ENCRYPTION_AES256:
                 {
-                    u32 salt_length = getSaltLength(header.encryption);
-                    MANGO_UNREFERENCED_PARAMETER(salt_length);
-                    MANGO_EXCEPTION(ID"AES encryption is not yet supported.");
-#if 0                
-                    u8* saltvalue = address;
-                    address += salt_length;
-
-                    u8* passverify = address;
-                    address += AES_PWVERIFYSIZE;
-
-                    address += HMAC_LENGTH;
-
-                    size_t compressed_size = size_t(header.compressedSize);
-                    compressed_size -= salt_length;
-                    compressed_size -= AES_PWVERIFYSIZE;
-                    compressed_size -= HMAC_LENGTH;
-
-                    // TODO: password + salt --> key
-                    // TODO: decrypt using the generated key
-#endif                
+                    // salt, password verification value, encrypted data, authentication code
+                    const u32 salt_length = getSaltLength(header.encryption);
+                    const u64 overhead = salt_length + AES_PWVERIFYSIZE + AES_AUTHCODESIZE;
+                    if (compressed_size < overhead)
+                    {
+                        MANGO_EXCEPTION(ID"Incorrect AES encrypted data.");
+                    }
+
+                    const u8* salt = address;
+                    const u8* passverify = address + salt_length;
+                    address += salt_length + AES_PWVERIFYSIZE;
+                    compressed_size -= overhead;
+                    const u8* authcode = address + compressed_size;
+
+                    MANGO_TRACE_SCOPE("zip", "decrypt");
+
+                    ZipDecrypterAES decrypter(getKeyBits(header.encryption), salt, password);
+                    if (!decrypter.verify(passverify))
+                    {
+                        MANGO_EXCEPTION(ID"Decryption failed (probably incorrect password).");
+                    }
+
+                    buffer = new u8[size_t(compressed_size)];
+
+                    if (!decrypter.decrypt(buffer, address, size_t(compressed_size), authcode))
+                    {
+                        delete[] buffer;
+                        MANGO_EXCEPTION(ID"Decryption failed (authentication code mismatch).");
+                    }
+
+                    address = buffer;
                     break;
                 }
             }
 
+            MANGO_TRACE_SCOPE("zip", "decompress");
+
             switch (header.compression)
             {
                 case COMPRESSION_NONE:
@@ -696,7 +1004,7 @@ namespace filesystem {
                     const size_t uncompressed_size = size_t(header.uncompressedSize);
                     u8* uncompressed_buffer = new u8[uncompressed_size];
 
-                    u64 outsize = zip_decompress(address, uncompressed_buffer, header.compressedSize, header.uncompressedSize);
+                    u64 outsize = zip_decompress(address, uncompressed_buffer, compressed_size, header.uncompressedSize);
 
                     delete[] buffer;
                     buffer = uncompressed_buffer;
@@ -720,7 +1028,7 @@ namespace filesystem {
                     u8* uncompressed_buffer = new u8[uncompressed_size];
 
                     // parse LZMA compression header
-                    p = address;
+                    LittleEndianPointer p = address;
                     p += 2; // skip LZMA version
                     u16 lzma_propsize = p.read16();
                     if (lzma_propsize != 5)
@@ -729,7 +1037,7 @@ namespace filesystem {
                         MANGO_EXCEPTION(ID"Incorrect LZMA header.");
                     }
                     address = p;
-                    u64 compressed_size = header.compressedSize - 4;
+                    compressed_size -= 4;
 
                     lzma::decompress(Memory(uncompressed_buffer, size_t(header.uncompressedSize)), Memory(address, size_t(compressed_size)));
 
@@ -747,7 +1055,7 @@ namespace filesystem {
                     const std::size_t uncompressed_size = static_cast<std::size_t>(header.uncompressedSize);
                     u8* uncompressed_buffer = new u8[uncompressed_size];
 
-                    ppmd8::decompress(Memory(uncompressed_buffer, size_t(header.uncompressedSize)), Memory(address, size_t(header.compressedSize)));
+                    ppmd8::decompress(Memory(uncompressed_buffer, size_t(header.uncompressedSize)), Memory(address, size_t(compressed_size)));
 
                     delete[] buffer;
                     buffer = uncompressed_buffer;
@@ -763,7 +1071,7 @@ namespace filesystem {
                     const std::size_t uncompressed_size = static_cast<std::size_t>(header.uncompressedSize);
                     u8* uncompressed_buffer = new u8[uncompressed_size];
 
-                    bzip2::decompress(Memory(uncompressed_buffer, size_t(header.uncompressedSize)), Memory(address, size_t(header.compressedSize)));
+                    bzip2::decompress(Memory(uncompressed_buffer, size_t(header.uncompressedSize)), Memory(address, size_t(compressed_size)));
 
                     delete[] buffer;
                     buffer = uncompressed_buffer;
@@ -850,6 +1158,51 @@ namespace filesystem {
             const FileHeader& header = *ptrHeader;
             return mmap(header, m_parent_memory.address, m_password);
         }
+
+        VirtualMemory* mmapRange(const std::string& filename, u64 offset, u64 size) override
+        {
+            const FileHeader* ptrHeader = m_folders.getHeader(filename);
+            if (!ptrHeader)
+            {
+                MANGO_EXCEPTION(ID"File \"%s\" not found.", filename.c_str());
+            }
+
+            const FileHeader& header = *ptrHeader;
+
+            if (header.encryption != ENCRYPTION_NONE || header.compression != COMPRESSION_DEFLATE)
+            {
+                return AbstractMapper::mmapRange(filename, offset, size);
+            }
+
+            offset = std::min(offset, header.uncompressedSize);
+            size = std::min(size, header.uncompressedSize - offset);
+
+            MANGO_TRACE_SCOPE("zip", "decompress range");
+
+            u8* buffer = new u8[size_t(size)];
+
+            try
+            {
+                if (offset < inflate_checkpoint_interval)
+                {
+                    // the beginning of the file is decoded without a checkpoint
+                    Memory input(getFileAddress(header, m_parent_memory.address), size_t(header.compressedSize));
+                    InflateIndex index(input, header.uncompressedSize);
+                    index.decode(buffer, offset, size);
+                }
+                else
+                {
+                    getInflateIndex(header)->decode(buffer, offset, size);
+                }
+            }
+            catch (...)
+            {
+                delete[] buffer;
+                throw;
+            }
+
+            return new VirtualMemoryZIP(buffer, buffer, size_t(size));
+        }
     };
 
     // -----------------------------------------------------------------
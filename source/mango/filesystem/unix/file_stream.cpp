@@ -5,16 +5,233 @@
 #if __ANDROID_API__ < __ANDROID_API_N__
 #define _FILE_OFFSET_BITS 64 /* LFS: 64 bit off_t */
 #endif
-#include <cstdio>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <algorithm>
+#include <exception>
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #include <mango/core/string.hpp>
 #include <mango/core/exception.hpp>
+#include <mango/core/memory.hpp>
 #include <mango/filesystem/file.hpp>
 
+#if defined(MANGO_PLATFORM_LINUX) && defined(__has_include)
+    #if __has_include(<linux/io_uring.h>)
+        #include <sys/mman.h>
+        #include <sys/syscall.h>
+        #include <linux/io_uring.h>
+        #if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+            #define MANGO_ENABLE_IO_URING
+        #endif
+    #endif
+#endif
+
 #define ID "[FileStream] "
 
+namespace
+{
+    using namespace mango;
+
+    void writeFully(int fd, const u8* data, size_t size, u64 offset)
+    {
+        while (size > 0)
+        {
+            ssize_t status = ::pwrite(fd, data, size, off_t(offset));
+            if (status < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                MANGO_EXCEPTION(ID"pwrite() failed: %s", std::strerror(errno));
+            }
+
+            data += status;
+            size -= size_t(status);
+            offset += u64(status);
+        }
+    }
+
+    size_t readFully(int fd, u8* dest, size_t size, u64 offset)
+    {
+        size_t total = 0;
+
+        while (total < size)
+        {
+            ssize_t status = ::pread(fd, dest + total, size - total, off_t(offset + total));
+            if (status < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                MANGO_EXCEPTION(ID"pread() failed: %s", std::strerror(errno));
+            }
+
+            if (!status)
+            {
+                // end of file
+                break;
+            }
+
+            total += size_t(status);
+        }
+
+        return total;
+    }
+
+#if defined(MANGO_ENABLE_IO_URING)
+
+    // -----------------------------------------------------------------
+    // IoRing
+    // -----------------------------------------------------------------
+
+    // minimal io_uring interface for submitting vectored writes
+
+    class IoRing : private NonCopyable
+    {
+    protected:
+        int m_fd = -1;
+
+        void* m_sq_ring = MAP_FAILED;
+        size_t m_sq_ring_size = 0;
+        void* m_cq_ring = MAP_FAILED;
+        size_t m_cq_ring_size = 0;
+        void* m_sqes = MAP_FAILED;
+        size_t m_sqes_size = 0;
+
+        unsigned* m_sq_tail;
+        unsigned* m_sq_mask;
+        unsigned* m_sq_array;
+        unsigned* m_cq_head;
+        unsigned* m_cq_tail;
+        unsigned* m_cq_mask;
+        io_uring_cqe* m_cqes;
+
+        template <typename T>
+        static T* offset(void* base, u32 offset)
+        {
+            return reinterpret_cast<T*>(reinterpret_cast<u8*>(base) + offset);
+        }
+
+    public:
+        IoRing() = default;
+
+        ~IoRing()
+        {
+            if (m_sqes != MAP_FAILED)
+                ::munmap(m_sqes, m_sqes_size);
+            if (m_cq_ring != MAP_FAILED && m_cq_ring != m_sq_ring)
+                ::munmap(m_cq_ring, m_cq_ring_size);
+            if (m_sq_ring != MAP_FAILED)
+                ::munmap(m_sq_ring, m_sq_ring_size);
+            if (m_fd >= 0)
+                ::close(m_fd);
+        }
+
+        bool init(unsigned entries)
+        {
+            io_uring_params params;
+            std::memset(&params, 0, sizeof(params));
+
+            // fails with ENOSYS on old kernels and EPERM when io_uring is disabled
+            m_fd = int(::syscall(__NR_io_uring_setup, entries, &params));
+            if (m_fd < 0)
+                return false;
+
+            m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+            const bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+            if (single)
+            {
+                m_sq_ring_size = std::max(m_sq_ring_size, m_cq_ring_size);
+                m_cq_ring_size = m_sq_ring_size;
+            }
+
+            m_sq_ring = ::mmap(nullptr, m_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+            if (m_sq_ring == MAP_FAILED)
+                return false;
+
+            m_cq_ring = single ? m_sq_ring :
+                ::mmap(nullptr, m_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+            if (m_cq_ring == MAP_FAILED)
+                return false;
+
+            m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+            m_sqes = ::mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+            if (m_sqes == MAP_FAILED)
+                return false;
+
+            m_sq_tail = offset<unsigned>(m_sq_ring, params.sq_off.tail);
+            m_sq_mask = offset<unsigned>(m_sq_ring, params.sq_off.ring_mask);
+            m_sq_array = offset<unsigned>(m_sq_ring, params.sq_off.array);
+            m_cq_head = offset<unsigned>(m_cq_ring, params.cq_off.head);
+            m_cq_tail = offset<unsigned>(m_cq_ring, params.cq_off.tail);
+            m_cq_mask = offset<unsigned>(m_cq_ring, params.cq_off.ring_mask);
+            m_cqes = offset<io_uring_cqe>(m_cq_ring, params.cq_off.cqes);
+
+            return true;
+        }
+
+        // the iovec must remain valid until the write has completed
+        void writev(int fd, const struct iovec* iov, u64 position, u64 user)
+        {
+            const unsigned tail = *m_sq_tail;
+            const unsigned index = tail & *m_sq_mask;
+
+            io_uring_sqe& sqe = reinterpret_cast<io_uring_sqe*>(m_sqes)[index];
+            std::memset(&sqe, 0, sizeof(sqe));
+
+            sqe.opcode = IORING_OP_WRITEV;
+            sqe.fd = fd;
+            sqe.addr = u64(reinterpret_cast<uintptr_t>(iov));
+            sqe.len = 1;
+            sqe.off = position;
+            sqe.user_data = user;
+
+            m_sq_array[index] = index;
+            __atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+            for (;;)
+            {
+                int status = int(::syscall(__NR_io_uring_enter, m_fd, 1, 0, 0, nullptr, 0));
+                if (status >= 0)
+                    break;
+                if (errno != EINTR)
+                    MANGO_EXCEPTION(ID"io_uring_enter() failed: %s", std::strerror(errno));
+            }
+        }
+
+        // wait for the next completion
+        void complete(u64& user, int& result)
+        {
+            for (;;)
+            {
+                const unsigned head = *m_cq_head;
+                const unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+
+                if (head != tail)
+                {
+                    const io_uring_cqe& cqe = m_cqes[head & *m_cq_mask];
+                    user = cqe.user_data;
+                    result = cqe.res;
+                    __atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+                    return;
+                }
+
+                int status = int(::syscall(__NR_io_uring_enter, m_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0));
+                if (status < 0 && errno != EINTR)
+                    MANGO_EXCEPTION(ID"io_uring_enter() failed: %s", std::strerror(errno));
+            }
+        }
+    };
+
+#endif // MANGO_ENABLE_IO_URING
+
+} // namespace
+
 namespace mango {
 namespace filesystem {
 
@@ -22,20 +239,152 @@ namespace filesystem {
 	// FileHandle
     // -----------------------------------------------------------------
 
+    /*
+        The file is accessed with pread/pwrite through aligned buffers which are
+        flushed in BUFFER_SIZE pieces at aligned offsets, which is what O_DIRECT
+        requires. The unaligned tail of the file (and everything after a seek) is
+        written with O_DIRECT turned off. With io_uring the full buffers are written
+        asynchronously while the next buffer is being filled.
+    */
+
 	struct FileHandle
 	{
-		FILE* m_file;
+        enum
+        {
+            DIRECT_ALIGNMENT = 4096,
+            BUFFER_SIZE = 1024 * 1024,
+            ASYNC_BUFFERS = 4
+        };
+
+        struct WriteBuffer
+        {
+            u8* data;
+            size_t used;
+            u64 offset;
+            bool pending;
+            struct iovec iov;
+        };
+
         std::string m_filename;
+        int m_fd;
+        bool m_write;
+        bool m_direct;
 
-        FileHandle(const std::string& filename, const char* mode)
-            : m_file(std::fopen(filename.c_str(), mode))
-            , m_filename(filename)
+        u64 m_size;
+        u64 m_position;
+
+        // read cache: file range [m_read_offset, m_read_offset + m_read_size) in m_buffers[0]
+        u64 m_read_offset;
+        size_t m_read_size;
+
+        std::vector<WriteBuffer> m_buffers;
+        size_t m_current;
+
+#if defined(MANGO_ENABLE_IO_URING)
+        std::unique_ptr<IoRing> m_ring;
+#endif
+
+        FileHandle(const std::string& filename, bool write, u32 flags)
+            : m_filename(filename)
+            , m_fd(-1)
+            , m_write(write)
+            , m_direct(false)
+            , m_size(0)
+            , m_position(0)
+            , m_read_offset(0)
+            , m_read_size(0)
+            , m_current(0)
 		{
+            if (write)
+            {
+                const int mode = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+
+#if defined(O_DIRECT)
+                if (flags & FileStream::DIRECT)
+                {
+                    // not all filesystems support direct I/O
+                    m_fd = ::open(filename.c_str(), mode | O_DIRECT, 0644);
+                    m_direct = m_fd >= 0;
+                }
+#endif
+
+                if (m_fd < 0)
+                {
+                    m_fd = ::open(filename.c_str(), mode, 0644);
+                }
+            }
+            else
+            {
+                m_fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+            }
+
+            if (m_fd < 0)
+            {
+                MANGO_EXCEPTION(ID"Cannot open file \"%s\": %s", filename.c_str(), std::strerror(errno));
+            }
+
+            if (!write)
+            {
+                struct stat sb;
+                ::fstat(m_fd, &sb);
+                m_size = u64(sb.st_size);
+            }
+
+            size_t count = 1;
+
+#if defined(MANGO_ENABLE_IO_URING)
+            if (write && (flags & FileStream::ASYNC))
+            {
+                m_ring.reset(new IoRing());
+                if (m_ring->init(ASYNC_BUFFERS))
+                {
+                    count = ASYNC_BUFFERS;
+                }
+                else
+                {
+                    // fall back to synchronous writes
+                    m_ring.reset();
+                }
+            }
+#else
+            MANGO_UNREFERENCED_PARAMETER(flags);
+#endif
+
+            for (size_t i = 0; i < count; ++i)
+            {
+                WriteBuffer buffer;
+                buffer.data = reinterpret_cast<u8*>(aligned_malloc(BUFFER_SIZE, DIRECT_ALIGNMENT));
+                buffer.used = 0;
+                buffer.offset = 0;
+                buffer.pending = false;
+                m_buffers.push_back(buffer);
+            }
 		}
 
 		~FileHandle()
 		{
-            std::fclose(m_file);
+            if (m_write)
+            {
+                try
+                {
+                    flush();
+                }
+                catch (...)
+                {
+                    // NOTE: errors can't be reported from the destructor; FileStream::flush() reports them
+                }
+            }
+
+#if defined(MANGO_ENABLE_IO_URING)
+            m_ring.reset();
+#endif
+
+            for (auto& buffer : m_buffers)
+            {
+                aligned_free(buffer.data);
+            }
+
+            ::close(m_fd);
 		}
 
         const std::string& filename() const
@@ -43,55 +392,328 @@ namespace filesystem {
             return m_filename;
         }
 
+        void disableDirect()
+        {
+#if defined(O_DIRECT)
+            if (m_direct)
+            {
+                int flags = ::fcntl(m_fd, F_GETFL);
+                ::fcntl(m_fd, F_SETFL, flags & ~O_DIRECT);
+                m_direct = false;
+            }
+#endif
+        }
+
+        void wait(WriteBuffer& buffer)
+        {
+#if defined(MANGO_ENABLE_IO_URING)
+            while (buffer.pending)
+            {
+                u64 index;
+                int result;
+                m_ring->complete(index, result);
+
+                WriteBuffer& completed = m_buffers[size_t(index)];
+                completed.pending = false;
+
+                if (result < 0)
+                {
+                    MANGO_EXCEPTION(ID"Asynchronous write failed: %s", std::strerror(-result));
+                }
+
+                if (size_t(result) < completed.used)
+                {
+                    // short write; finish the rest synchronously
+                    disableDirect();
+                    writeFully(m_fd, completed.data + result, completed.used - result, completed.offset + result);
+                }
+
+                completed.used = 0;
+            }
+#else
+            MANGO_UNREFERENCED_PARAMETER(buffer);
+#endif
+        }
+
+        void submit()
+        {
+            WriteBuffer& buffer = m_buffers[m_current];
+            if (!buffer.used)
+                return;
+
+            if (buffer.offset % DIRECT_ALIGNMENT || buffer.used % DIRECT_ALIGNMENT)
+            {
+                // direct I/O needs aligned offset and size; in-flight writes finish first
+                if (m_direct)
+                {
+                    for (auto& node : m_buffers)
+                    {
+                        wait(node);
+                    }
+
+                    disableDirect();
+                }
+            }
+
+#if defined(MANGO_ENABLE_IO_URING)
+            if (m_ring)
+            {
+                buffer.iov.iov_base = buffer.data;
+                buffer.iov.iov_len = buffer.used;
+                buffer.pending = true;
+                m_ring->writev(m_fd, &buffer.iov, buffer.offset, m_current);
+
+                // continue filling the next buffer
+                m_current = (m_current + 1) % m_buffers.size();
+                wait(m_buffers[m_current]);
+                return;
+            }
+#endif
+
+            writeFully(m_fd, buffer.data, buffer.used, buffer.offset);
+            buffer.used = 0;
+        }
+
+        void flush()
+        {
+            std::exception_ptr error;
+
+            try
+            {
+                submit();
+            }
+            catch (...)
+            {
+                error = std::current_exception();
+            }
+
+            // drain every pending write before reporting the first error, so that
+            // no buffer is released while the kernel is still reading it
+            for (auto& buffer : m_buffers)
+            {
+                try
+                {
+                    wait(buffer);
+                }
+                catch (...)
+                {
+                    if (!error)
+                        error = std::current_exception();
+                }
+            }
+
+            if (error)
+            {
+                std::rethrow_exception(error);
+            }
+        }
+
         u64 size() const
 		{
-            struct stat sb;
-            int fd = ::fileno(m_file);
-            ::fflush(m_file);
-            ::fstat(fd, &sb);
-            return sb.st_size;
+            return m_size;
 		}
 
 		u64 offset() const
 		{
-	        return ftello(m_file);
+            return m_position;
 		}
 
 		void seek(u64 distance, int method)
 		{
-	        fseeko(m_file, distance, method);
+            if (m_write)
+            {
+                flush();
+            }
+
+            switch (method)
+            {
+                case SEEK_SET:
+                    m_position = distance;
+                    break;
+
+                case SEEK_CUR:
+                    m_position += distance;
+                    break;
+
+                case SEEK_END:
+                    m_position = m_size - distance;
+                    break;
+            }
 		}
 
 	    void read(void* dest, size_t size)
 	    {
-    	    size_t status = std::fread(dest, 1, size, m_file);
-	        MANGO_UNREFERENCED_PARAMETER(status);
+            if (m_write)
+                return;
+
+            u8* output = reinterpret_cast<u8*>(dest);
+            u8* cache = m_buffers[0].data;
+
+            while (size > 0)
+            {
+                if (m_position >= m_read_offset && m_position < m_read_offset + m_read_size)
+                {
+                    const size_t offset = size_t(m_position - m_read_offset);
+                    const size_t bytes = std::min(size, m_read_size - offset);
+                    std::memcpy(output, cache + offset, bytes);
+
+                    output += bytes;
+                    size -= bytes;
+                    m_position += bytes;
+                }
+                else if (size >= BUFFER_SIZE)
+                {
+                    // large reads go directly to the destination
+                    m_position += readFully(m_fd, output, size, m_position);
+                    break;
+                }
+                else
+                {
+                    m_read_offset = m_position;
+                    m_read_size = readFully(m_fd, cache, BUFFER_SIZE, m_position);
+                    if (!m_read_size)
+                        break;
+                }
+            }
 	    }
 
 	    void write(const void* data, size_t size)
 	    {
-	        size_t status = std::fwrite(data, 1, size, m_file);
-	        MANGO_UNREFERENCED_PARAMETER(status);
+            if (!m_write)
+                return;
+
+            const u8* input = reinterpret_cast<const u8*>(data);
+
+            while (size > 0)
+            {
+                WriteBuffer& buffer = m_buffers[m_current];
+
+                if (!buffer.used)
+                {
+                    if (size >= BUFFER_SIZE && !m_direct && !isAsync())
+                    {
+                        // large writes skip the copy into the buffer
+                        writeFully(m_fd, input, size, m_position);
+                        m_position += size;
+                        break;
+                    }
+
+                    buffer.offset = m_position;
+                }
+
+                const size_t bytes = std::min(size, BUFFER_SIZE - buffer.used);
+                std::memcpy(buffer.data + buffer.used, input, bytes);
+
+                buffer.used += bytes;
+                input += bytes;
+                size -= bytes;
+                m_position += bytes;
+
+                if (buffer.used == BUFFER_SIZE)
+                {
+                    submit();
+                }
+            }
+
+            m_size = std::max(m_size, m_position);
 	    }
+
+        void write(const Memory* segments, size_t count)
+        {
+            if (!m_write)
+                return;
+
+            size_t bytes = 0;
+
+            for (size_t i = 0; i < count; ++i)
+            {
+                bytes += segments[i].size;
+            }
+
+#if defined(MANGO_PLATFORM_LINUX)
+            if (bytes >= BUFFER_SIZE && !m_direct && !isAsync())
+            {
+                // large gathers go directly to the file
+                submit();
+
+                struct iovec iov[64];
+                const size_t limit = std::min(size_t(IOV_MAX), size_t(64));
+
+                size_t index = 0;
+                size_t skip = 0; // bytes of segments[index] already written
+
+                while (index < count)
+                {
+                    size_t n = 0;
+
+                    for (size_t i = index; i < count && n < limit; ++i)
+                    {
+                        const size_t offset = i == index ? skip : 0;
+                        iov[n].iov_base = segments[i].address + offset;
+                        iov[n].iov_len = segments[i].size - offset;
+                        ++n;
+                    }
+
+                    ssize_t status = ::pwritev(m_fd, iov, int(n), off_t(m_position));
+                    if (status < 0)
+                    {
+                        if (errno == EINTR)
+                            continue;
+                        MANGO_EXCEPTION(ID"pwritev() failed: %s", std::strerror(errno));
+                    }
+
+                    m_position += u64(status);
+
+                    // advance past the written bytes
+                    size_t written = size_t(status) + skip;
+
+                    while (index < count && written >= segments[index].size)
+                    {
+                        written -= segments[index].size;
+                        ++index;
+                    }
+
+                    skip = written;
+                }
+
+                m_size = std::max(m_size, m_position);
+                return;
+            }
+#endif
+
+            for (size_t i = 0; i < count; ++i)
+            {
+                write(segments[i].address, segments[i].size);
+            }
+        }
+
+        bool isAsync() const
+        {
+#if defined(MANGO_ENABLE_IO_URING)
+            return m_ring != nullptr;
+#else
+            return false;
+#endif
+        }
 	};
 
     // -----------------------------------------------------------------
     // FileStream
     // -----------------------------------------------------------------
 
-    FileStream::FileStream(const std::string& filename, OpenMode openmode)
+    FileStream::FileStream(const std::string& filename, OpenMode openmode, u32 flags)
         : m_handle(nullptr)
     {
-		const char* mode;
+        bool write;
 
        	switch (openmode)
         {
    	        case READ:
-                mode = "rb";
+                write = false;
                 break;
 
    	        case WRITE:
-       	        mode = "wb";
+                write = true;
            	    break;
 
             default:
@@ -99,7 +721,7 @@ namespace filesystem {
                 break;
         }
 
-		m_handle = new FileHandle(filename, mode);
+		m_handle = new FileHandle(filename, write, flags);
     }
 
     FileStream::~FileStream()
@@ -157,5 +779,18 @@ namespace filesystem {
 		m_handle->write(data, size);
     }
 
+    void FileStream::write(const Memory* segments, size_t count)
+    {
+        m_handle->write(segments, count);
+    }
+
+    void FileStream::flush()
+    {
+        if (m_handle->m_write)
+        {
+            m_handle->flush();
+        }
+    }
+
 } // namespace filesystem
 } // namespace mango
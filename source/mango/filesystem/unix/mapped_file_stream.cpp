@@ -0,0 +1,235 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2019 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#if __ANDROID_API__ < __ANDROID_API_N__
+#define _FILE_OFFSET_BITS 64 /* LFS: 64 bit off_t */
+#endif
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <mango/core/exception.hpp>
+#include <mango/filesystem/file.hpp>
+
+#define ID "[MappedFileStream] "
+
+namespace mango {
+namespace filesystem {
+
+    // -----------------------------------------------------------------
+    // MappedFileHandle
+    // -----------------------------------------------------------------
+
+    struct MappedFileHandle
+    {
+        enum : u64
+        {
+            MIN_GROWTH = 64 * 1024 * 1024
+        };
+
+        std::string m_filename;
+        int m_fd;
+        u8* m_address;
+        u64 m_capacity;
+        u64 m_size;
+        u64 m_offset;
+
+        MappedFileHandle(const std::string& filename)
+            : m_filename(filename)
+            , m_fd(-1)
+            , m_address(nullptr)
+            , m_capacity(0)
+            , m_size(0)
+            , m_offset(0)
+        {
+            m_fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (m_fd < 0)
+            {
+                MANGO_EXCEPTION(ID"Cannot open file \"%s\": %s", filename.c_str(), std::strerror(errno));
+            }
+        }
+
+        ~MappedFileHandle()
+        {
+            if (m_address)
+            {
+                ::munmap(m_address, size_t(m_capacity));
+            }
+
+            // remove the unused capacity
+            int status = ::ftruncate(m_fd, off_t(m_size));
+            MANGO_UNREFERENCED_PARAMETER(status);
+
+            ::close(m_fd);
+        }
+
+        void reserve(u64 required)
+        {
+            if (required <= m_capacity)
+                return;
+
+            static const u64 page = u64(::sysconf(_SC_PAGESIZE));
+
+            u64 capacity = std::max(required, std::max(m_capacity * 2, u64(MIN_GROWTH)));
+            capacity = (capacity + page - 1) & ~(page - 1);
+
+            if (::ftruncate(m_fd, off_t(capacity)) < 0)
+            {
+                MANGO_EXCEPTION(ID"ftruncate() failed: %s", std::strerror(errno));
+            }
+
+            void* address;
+
+#if defined(MANGO_PLATFORM_LINUX)
+            if (m_address)
+            {
+                address = ::mremap(m_address, size_t(m_capacity), size_t(capacity), MREMAP_MAYMOVE);
+            }
+            else
+            {
+                address = ::mmap(nullptr, size_t(capacity), PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+            }
+#else
+            if (m_address)
+            {
+                ::munmap(m_address, size_t(m_capacity));
+            }
+
+            address = ::mmap(nullptr, size_t(capacity), PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+#endif
+
+            if (address == MAP_FAILED)
+            {
+                m_address = nullptr;
+                m_capacity = 0;
+                MANGO_EXCEPTION(ID"Mapping failed: %s", std::strerror(errno));
+            }
+
+            m_address = reinterpret_cast<u8*>(address);
+            m_capacity = capacity;
+        }
+
+        void sync()
+        {
+            if (m_address)
+            {
+                ::msync(m_address, size_t(m_size), MS_SYNC);
+            }
+        }
+    };
+
+    // -----------------------------------------------------------------
+    // MappedFileStream
+    // -----------------------------------------------------------------
+
+    MappedFileStream::MappedFileStream(const std::string& filename)
+        : m_handle(new MappedFileHandle(filename))
+    {
+    }
+
+    MappedFileStream::~MappedFileStream()
+    {
+        delete m_handle;
+    }
+
+    const std::string& MappedFileStream::filename() const
+    {
+        return m_handle->m_filename;
+    }
+
+    Memory MappedFileStream::acquire(size_t bytes)
+    {
+        m_handle->reserve(m_handle->m_offset + bytes);
+        return Memory(m_handle->m_address + m_handle->m_offset, bytes);
+    }
+
+    void MappedFileStream::commit(size_t bytes)
+    {
+        m_handle->reserve(m_handle->m_offset + bytes);
+        m_handle->m_offset += bytes;
+        m_handle->m_size = std::max(m_handle->m_size, m_handle->m_offset);
+    }
+
+    void MappedFileStream::sync()
+    {
+        m_handle->sync();
+    }
+
+    u64 MappedFileStream::size() const
+    {
+        return m_handle->m_size;
+    }
+
+    u64 MappedFileStream::offset() const
+    {
+        return m_handle->m_offset;
+    }
+
+    void MappedFileStream::seek(u64 distance, SeekMode mode)
+    {
+        switch (mode)
+        {
+            case BEGIN:
+                m_handle->m_offset = distance;
+                break;
+
+            case CURRENT:
+                m_handle->m_offset += distance;
+                break;
+
+            case END:
+                m_handle->m_offset = m_handle->m_size - distance;
+                break;
+
+            default:
+                MANGO_EXCEPTION(ID"Invalid seek mode.");
+        }
+    }
+
+    void MappedFileStream::read(void* dest, size_t size)
+    {
+        const u64 offset = m_handle->m_offset;
+
+        if (offset + size > m_handle->m_size)
+        {
+            MANGO_EXCEPTION(ID"Reading past end of file.");
+        }
+
+        std::memcpy(dest, m_handle->m_address + offset, size);
+        m_handle->m_offset += size;
+    }
+
+    void MappedFileStream::write(const void* data, size_t size)
+    {
+        Memory memory = acquire(size);
+        std::memcpy(memory.address, data, size);
+        commit(size);
+    }
+
+    void MappedFileStream::write(const Memory* segments, size_t count)
+    {
+        size_t bytes = 0;
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            bytes += segments[i].size;
+        }
+
+        // grow once for all of the segments
+        u8* dest = acquire(bytes).address;
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            std::memcpy(dest, segments[i].address, segments[i].size);
+            dest += segments[i].size;
+        }
+
+        commit(bytes);
+    }
+
+} // namespace filesystem
+} // namespace mango
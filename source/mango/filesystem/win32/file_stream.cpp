@@ -81,9 +81,12 @@ namespace filesystem {
     // FileStream
     // -----------------------------------------------------------------
 
-    FileStream::FileStream(const std::string& filename, OpenMode mode)
+    FileStream::FileStream(const std::string& filename, OpenMode mode, u32 flags)
         : m_handle(nullptr)
     {
+        // NOTE: the flags are not implemented; FILE_FLAG_NO_BUFFERING requires sector aligned writes
+        MANGO_UNREFERENCED_PARAMETER(flags);
+
         DWORD access;
         DWORD disposition;
 
@@ -169,5 +172,18 @@ namespace filesystem {
 		m_handle->write(data, size);
     }
 
+    void FileStream::write(const Memory* segments, size_t count)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            m_handle->write(segments[i].address, segments[i].size);
+        }
+    }
+
+    void FileStream::flush()
+    {
+        // the writes are not buffered by the stream
+    }
+
 } // namespace filesystem
 } // namespace mango
@@ -0,0 +1,226 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2019 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#include <algorithm>
+#include <mango/core/string.hpp>
+#include <mango/core/exception.hpp>
+#include <mango/filesystem/file.hpp>
+
+#define ID "[MappedFileStream] "
+
+namespace mango {
+namespace filesystem {
+
+    // -----------------------------------------------------------------
+    // MappedFileHandle
+    // -----------------------------------------------------------------
+
+    struct MappedFileHandle
+    {
+        enum : u64
+        {
+            MIN_GROWTH = 64 * 1024 * 1024
+        };
+
+        std::string m_filename;
+        HANDLE m_file;
+        HANDLE m_map;
+        u8* m_address;
+        u64 m_capacity;
+        u64 m_size;
+        u64 m_offset;
+
+        MappedFileHandle(const std::string& filename)
+            : m_filename(filename)
+            , m_file(INVALID_HANDLE_VALUE)
+            , m_map(nullptr)
+            , m_address(nullptr)
+            , m_capacity(0)
+            , m_size(0)
+            , m_offset(0)
+        {
+            m_file = CreateFileW(u16_fromBytes(filename).c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+            if (m_file == INVALID_HANDLE_VALUE)
+            {
+                MANGO_EXCEPTION(ID"CreateFileW() failed.");
+            }
+        }
+
+        ~MappedFileHandle()
+        {
+            unmap();
+
+            // remove the unused capacity
+            LARGE_INTEGER position;
+            position.QuadPart = LONGLONG(m_size);
+            SetFilePointerEx(m_file, position, NULL, FILE_BEGIN);
+            SetEndOfFile(m_file);
+
+            CloseHandle(m_file);
+        }
+
+        void unmap()
+        {
+            if (m_address)
+            {
+                UnmapViewOfFile(m_address);
+                m_address = nullptr;
+            }
+
+            if (m_map)
+            {
+                CloseHandle(m_map);
+                m_map = nullptr;
+            }
+        }
+
+        void reserve(u64 required)
+        {
+            if (required <= m_capacity)
+                return;
+
+            u64 capacity = std::max(required, std::max(m_capacity * 2, u64(MIN_GROWTH)));
+            capacity = (capacity + 0xffff) & ~u64(0xffff);
+
+            // the view can't be resized; map the grown file again
+            unmap();
+
+            // creating the mapping extends the file
+            m_map = CreateFileMappingW(m_file, NULL, PAGE_READWRITE, DWORD(capacity >> 32), DWORD(capacity), NULL);
+            if (m_map)
+            {
+                m_address = reinterpret_cast<u8*>(MapViewOfFile(m_map, FILE_MAP_ALL_ACCESS, 0, 0, 0));
+            }
+
+            if (!m_address)
+            {
+                unmap();
+                m_capacity = 0;
+                MANGO_EXCEPTION(ID"Mapping failed.");
+            }
+
+            m_capacity = capacity;
+        }
+
+        void sync()
+        {
+            if (m_address)
+            {
+                FlushViewOfFile(m_address, SIZE_T(m_size));
+                FlushFileBuffers(m_file);
+            }
+        }
+    };
+
+    // -----------------------------------------------------------------
+    // MappedFileStream
+    // -----------------------------------------------------------------
+
+    MappedFileStream::MappedFileStream(const std::string& filename)
+        : m_handle(new MappedFileHandle(filename))
+    {
+    }
+
+    MappedFileStream::~MappedFileStream()
+    {
+        delete m_handle;
+    }
+
+    const std::string& MappedFileStream::filename() const
+    {
+        return m_handle->m_filename;
+    }
+
+    Memory MappedFileStream::acquire(size_t bytes)
+    {
+        m_handle->reserve(m_handle->m_offset + bytes);
+        return Memory(m_handle->m_address + m_handle->m_offset, bytes);
+    }
+
+    void MappedFileStream::commit(size_t bytes)
+    {
+        m_handle->reserve(m_handle->m_offset + bytes);
+        m_handle->m_offset += bytes;
+        m_handle->m_size = std::max(m_handle->m_size, m_handle->m_offset);
+    }
+
+    void MappedFileStream::sync()
+    {
+        m_handle->sync();
+    }
+
+    u64 MappedFileStream::size() const
+    {
+        return m_handle->m_size;
+    }
+
+    u64 MappedFileStream::offset() const
+    {
+        return m_handle->m_offset;
+    }
+
+    void MappedFileStream::seek(u64 distance, SeekMode mode)
+    {
+        switch (mode)
+        {
+            case BEGIN:
+                m_handle->m_offset = distance;
+                break;
+
+            case CURRENT:
+                m_handle->m_offset += distance;
+                break;
+
+            case END:
+                m_handle->m_offset = m_handle->m_size - distance;
+                break;
+
+            default:
+                MANGO_EXCEPTION(ID"Invalid seek mode.");
+        }
+    }
+
+    void MappedFileStream::read(void* dest, size_t size)
+    {
+        const u64 offset = m_handle->m_offset;
+
+        if (offset + size > m_handle->m_size)
+        {
+            MANGO_EXCEPTION(ID"Reading past end of file.");
+        }
+
+        std::memcpy(dest, m_handle->m_address + offset, size);
+        m_handle->m_offset += size;
+    }
+
+    void MappedFileStream::write(const void* data, size_t size)
+    {
+        Memory memory = acquire(size);
+        std::memcpy(memory.address, data, size);
+        commit(size);
+    }
+
+    void MappedFileStream::write(const Memory* segments, size_t count)
+    {
+        size_t bytes = 0;
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            bytes += segments[i].size;
+        }
+
+        // grow once for all of the segments
+        u8* dest = acquire(bytes).address;
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            std::memcpy(dest, segments[i].address, segments[i].size);
+            dest += segments[i].size;
+        }
+
+        commit(bytes);
+    }
+
+} // namespace filesystem
+} // namespace mango
@@ -0,0 +1,510 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2019 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#include <algorithm>
+#include <set>
+#include <mango/core/core.hpp>
+#include <mango/filesystem/filesystem.hpp>
+
+#define ID "[MGXWriter] "
+
+namespace
+{
+    using namespace mango;
+    namespace fs = mango::filesystem;
+
+    constexpr u32 mgx_version = 1;
+
+    constexpr size_t mgx_packed_block_size = 1 << 20; // small files are packed into blocks of this size
+    constexpr size_t mgx_small_file_size = mgx_packed_block_size / 2;
+    constexpr size_t mgx_chunk_size = 4 << 20;        // large files are compressed in chunks of this size
+    constexpr size_t mgx_raw_alignment = 4096;        // uncompressed large files are page aligned
+    constexpr size_t mgx_max_segment = 1u << 31;      // segment size is stored in 32 bits
+    constexpr size_t mgx_window_size = 64 << 20;      // uncompressed bytes compressed in one batch
+
+    struct Segment
+    {
+        u32 block;
+        u32 offset;
+        u32 size;
+    };
+
+    struct Entry
+    {
+        std::string filename;
+        Memory memory;
+        std::unique_ptr<fs::File> file;
+        u32 checksum = 0;
+        bool incompressible = false;
+        Buffer probe; // compressed first chunk of a large file
+        std::vector<Segment> segments;
+    };
+
+    struct Job
+    {
+        std::vector<Memory> pieces;
+        size_t size = 0;
+        bool raw = false;   // stored without compression
+        bool align = false; // the block can be mapped directly so align it
+        bool done = false;  // compressed while analyzing the file
+        u64 offset = 0;
+        u64 compressed = 0;
+        Buffer buffer;
+    };
+
+    std::string normalize(std::string filename)
+    {
+        std::replace(filename.begin(), filename.end(), '\\', '/');
+        return filename;
+    }
+
+} // namespace
+
+namespace mango {
+namespace filesystem {
+
+    // -----------------------------------------------------------------
+    // WriterMGX
+    // -----------------------------------------------------------------
+
+    struct WriterMGX
+    {
+        Stream& m_output;
+        Compressor m_compressor;
+        int m_level;
+        bool m_finished;
+
+        std::vector<std::unique_ptr<Entry>> m_entries;
+        std::vector<Job> m_jobs;
+        BufferCache m_cache;
+
+        WriterMGX(Stream& output, const Compressor& compressor, int level)
+            : m_output(output)
+            , m_compressor(compressor)
+            , m_level(level)
+            , m_finished(false)
+        {
+        }
+
+        void add(const std::string& filename, Memory memory, std::unique_ptr<File> file)
+        {
+            if (m_finished)
+            {
+                MANGO_EXCEPTION(ID"The container is already written.");
+            }
+
+            Entry* entry = new Entry();
+            entry->filename = normalize(filename);
+            entry->memory = memory;
+            entry->file = std::move(file);
+            m_entries.emplace_back(entry);
+        }
+
+        void addTree(const Path& path, const std::string& prefix)
+        {
+            for (const FileInfo& node : path)
+            {
+                if (node.isDirectory())
+                {
+                    Path child(path, node.name);
+                    addTree(child, prefix + node.name);
+                }
+                else
+                {
+                    std::unique_ptr<File> file(new File(path, node.name));
+                    Memory memory = *file;
+                    add(prefix + node.name, memory, std::move(file));
+                }
+            }
+        }
+
+        bool isCompressing() const
+        {
+            return m_compressor.method != Compressor::NONE;
+        }
+
+        Job& appendJob()
+        {
+            m_jobs.emplace_back();
+            return m_jobs.back();
+        }
+
+        void analyze()
+        {
+            ConcurrentQueue queue("mgx.analyze");
+
+            for (auto& ptr : m_entries)
+            {
+                Entry* entry = ptr.get();
+
+                queue.enqueue([this, entry] {
+                    entry->checksum = crc32c(0, entry->memory);
+
+                    if (isCompressing() && entry->memory.size >= mgx_small_file_size)
+                    {
+                        // compress the beginning of a large file to see if it is worth it
+                        Memory probe(entry->memory.address, std::min(entry->memory.size, mgx_chunk_size));
+
+                        Buffer buffer = m_cache.acquire(m_compressor.bound(probe.size));
+                        buffer.resize(m_compressor.bound(probe.size));
+                        size_t bytes = m_compressor.compress(buffer, probe, m_level);
+
+                        entry->incompressible = bytes * 8 > probe.size * 7;
+                        if (entry->incompressible)
+                        {
+                            m_cache.recycle(buffer);
+                        }
+                        else
+                        {
+                            // the probe is the first chunk of the file
+                            buffer.resize(bytes);
+                            entry->probe = std::move(buffer);
+                        }
+                    }
+                });
+            }
+
+            queue.wait();
+        }
+
+        void plan()
+        {
+            std::vector<Entry*> small;
+            std::vector<Entry*> large;
+
+            for (auto& ptr : m_entries)
+            {
+                Entry* entry = ptr.get();
+                if (entry->memory.size < mgx_small_file_size)
+                    small.push_back(entry);
+                else
+                    large.push_back(entry);
+            }
+
+            // similar files next to each other compress better
+            std::stable_sort(small.begin(), small.end(), [] (const Entry* a, const Entry* b) {
+                std::string ea = getExtension(a->filename);
+                std::string eb = getExtension(b->filename);
+                return ea != eb ? ea < eb : a->filename < b->filename;
+            });
+
+            for (Entry* entry : small)
+            {
+                const size_t size = entry->memory.size;
+
+                if (m_jobs.empty() || m_jobs.back().size + size > mgx_packed_block_size)
+                {
+                    appendJob().raw = !isCompressing();
+                }
+
+                Job& packed = m_jobs.back();
+
+                const u32 block = u32(m_jobs.size() - 1);
+                entry->segments.push_back({ block, u32(packed.size), u32(size) });
+
+                packed.pieces.push_back(entry->memory);
+                packed.size += size;
+            }
+
+            for (Entry* entry : large)
+            {
+                const bool raw = !isCompressing() || entry->incompressible;
+                const size_t chunk = raw ? mgx_max_segment : mgx_chunk_size;
+
+                for (size_t offset = 0; offset < entry->memory.size; offset += chunk)
+                {
+                    const size_t size = std::min(chunk, entry->memory.size - offset);
+
+                    Job& job = appendJob();
+                    job.pieces.push_back(Memory(entry->memory.address + offset, size));
+                    job.size = size;
+                    job.raw = raw;
+                    job.align = raw;
+
+                    if (!offset && entry->probe.size())
+                    {
+                        job.buffer = std::move(entry->probe);
+                        job.done = true;
+                    }
+
+                    const u32 block = u32(m_jobs.size() - 1);
+                    entry->segments.push_back({ block, 0, u32(size) });
+                }
+            }
+        }
+
+        void compress(Job& job)
+        {
+            if (!job.size)
+            {
+                job.raw = true;
+                return;
+            }
+
+            ScratchScope scratch;
+
+            Memory source = job.pieces[0];
+
+            if (job.pieces.size() > 1)
+            {
+                u8* temp = scratch.allocate<u8>(job.size);
+                source = Memory(temp, job.size);
+
+                for (const Memory& piece : job.pieces)
+                {
+                    std::memcpy(temp, piece.address, piece.size);
+                    temp += piece.size;
+                }
+            }
+
+            const size_t bound = m_compressor.bound(job.size);
+
+            Buffer buffer = m_cache.acquire(bound);
+            buffer.resize(bound);
+
+            size_t bytes = m_compressor.compress(buffer, source, m_level);
+            if (bytes + bytes / 32 >= job.size)
+            {
+                // not worth decompressing
+                m_cache.recycle(buffer);
+                job.raw = true;
+                return;
+            }
+
+            buffer.resize(bytes);
+            job.buffer = std::move(buffer);
+        }
+
+        void enqueue(ConcurrentQueue& queue, size_t first, size_t last)
+        {
+            for (size_t i = first; i < last; ++i)
+            {
+                Job* job = &m_jobs[i];
+                if (!job->raw && !job->done)
+                {
+                    queue.enqueue([this, job] {
+                        MANGO_TRACE_SCOPE("mgx", "compress");
+                        compress(*job);
+                    });
+                }
+            }
+        }
+
+        size_t window(size_t first) const
+        {
+            size_t last = first;
+            size_t bytes = 0;
+
+            while (last < m_jobs.size() && (bytes < mgx_window_size || last == first))
+            {
+                bytes += m_jobs[last++].size;
+            }
+
+            return last;
+        }
+
+        void writeBlocks(u64 base)
+        {
+            // compress the next batch while the current one is written
+            ConcurrentQueue queue0("mgx.compressor");
+            ConcurrentQueue queue1("mgx.compressor");
+            ConcurrentQueue* queues[] = { &queue0, &queue1 };
+
+            size_t first = 0;
+            size_t last = window(first);
+            enqueue(*queues[0], first, last);
+
+            for (int index = 0; first < m_jobs.size(); index ^= 1)
+            {
+                const size_t next = window(last);
+                enqueue(*queues[index ^ 1], last, next);
+
+                queues[index]->wait();
+
+                for (size_t i = first; i < last; ++i)
+                {
+                    Job& job = m_jobs[i];
+
+                    if (job.align)
+                    {
+                        static const u8 zeros[mgx_raw_alignment] = { 0 };
+                        size_t padding = size_t(0 - (m_output.offset() - base)) & (mgx_raw_alignment - 1);
+                        m_output.write(zeros, padding);
+                    }
+
+                    job.offset = m_output.offset() - base;
+
+                    if (job.raw)
+                    {
+                        job.compressed = job.size;
+                        m_output.write(job.pieces.data(), job.pieces.size());
+                    }
+                    else
+                    {
+                        job.compressed = job.buffer.size();
+                        m_output.write(job.buffer);
+                        m_cache.recycle(job.buffer);
+                    }
+                }
+
+                first = last;
+                last = next;
+            }
+        }
+
+        void writeIndex(u64 base)
+        {
+            Buffer buffer;
+            LittleEndianStream s(buffer);
+
+            const u64 block_offset = m_output.offset() - base;
+
+            s.write32(make_u32('m', 'g', 'x', '1'));
+            s.write32(u32(m_jobs.size()));
+
+            for (const Job& job : m_jobs)
+            {
+                s.write64(job.offset);
+                s.write64(job.compressed);
+                s.write64(job.size);
+                s.write32(job.raw ? Compressor::NONE : m_compressor.method);
+            }
+
+            s.write32(make_u32('m', 'g', 'x', '2'));
+
+            const u64 file_offset = block_offset + buffer.size();
+
+            // the folders are files without segments
+            std::set<std::string> folders;
+
+            for (auto& entry : m_entries)
+            {
+                const std::string& filename = entry->filename;
+                for (size_t n = filename.find('/'); n != std::string::npos; n = filename.find('/', n + 1))
+                {
+                    folders.insert(filename.substr(0, n + 1));
+                }
+            }
+
+            s.write32(make_u32('m', 'g', 'x', '2'));
+            s.write32(u32(folders.size() + m_entries.size()));
+
+            for (const std::string& folder : folders)
+            {
+                s.write32(u32(folder.length()));
+                s.write(folder.c_str(), folder.length());
+                s.write64(0);
+                s.write32(0);
+                s.write32(0);
+            }
+
+            for (auto& entry : m_entries)
+            {
+                s.write32(u32(entry->filename.length()));
+                s.write(entry->filename.c_str(), entry->filename.length());
+                s.write64(entry->memory.size);
+                s.write32(entry->checksum);
+                s.write32(u32(entry->segments.size()));
+
+                for (const Segment& segment : entry->segments)
+                {
+                    s.write32(segment.block);
+                    s.write32(segment.offset);
+                    s.write32(segment.size);
+                }
+            }
+
+            s.write32(make_u32('m', 'g', 'x', '3'));
+
+            // header
+            s.write32(make_u32('m', 'g', 'x', '3'));
+            s.write32(mgx_version);
+            s.write64(block_offset);
+            s.write64(file_offset);
+
+            m_output.write(buffer);
+        }
+
+        void finish()
+        {
+            if (m_finished)
+                return;
+
+            m_finished = true;
+
+            MANGO_TRACE_SCOPE("mgx", "finish");
+
+            analyze();
+            plan();
+
+            const u64 base = m_output.offset();
+
+            LittleEndianStream s(m_output);
+            s.write32(make_u32('m', 'g', 'x', '0'));
+
+            writeBlocks(base);
+            writeIndex(base);
+
+            // the index is the last thing written; a buffered stream must report if it failed
+            m_output.flush();
+
+            m_jobs.clear();
+            m_entries.clear();
+        }
+    };
+
+    // -----------------------------------------------------------------
+    // MGXWriter
+    // -----------------------------------------------------------------
+
+    MGXWriter::MGXWriter(Stream& output, const Compressor& compressor, int level)
+        : m_writer(new WriterMGX(output, compressor, level))
+    {
+    }
+
+    MGXWriter::~MGXWriter()
+    {
+        try
+        {
+            m_writer->finish();
+        }
+        catch (...)
+        {
+            // destructor must not throw; call finish() explicitly to get the errors
+        }
+
+        delete m_writer;
+    }
+
+    void MGXWriter::add(const std::string& filename, Memory memory)
+    {
+        m_writer->add(filename, memory, nullptr);
+    }
+
+    void MGXWriter::addFile(const std::string& filename, const std::string& source)
+    {
+        std::unique_ptr<File> file(new File(source));
+        Memory memory = *file;
+        m_writer->add(filename, memory, std::move(file));
+    }
+
+    void MGXWriter::addTree(const std::string& pathname, const std::string& prefix)
+    {
+        std::string folder = pathname;
+        if (!folder.empty() && folder.back() != '/')
+        {
+            folder += '/';
+        }
+
+        Path path(folder);
+        m_writer->addTree(path, normalize(prefix));
+    }
+
+    void MGXWriter::finish()
+    {
+        m_writer->finish();
+    }
+
+} // namespace filesystem
+} // namespace mango
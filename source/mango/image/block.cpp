@@ -347,7 +347,8 @@ namespace
         rect.dest.stride = origin ? -surface.stride : surface.stride;
         rect.src.stride = block.width * block.format.bytes();
 
-        Buffer temp(block.height * rect.src.stride);
+        ScratchScope scratch;
+        u8* temp = scratch.allocate<u8>(block.height * rect.src.stride);
         rect.src.address = temp;
 
         const int pixelSize = block.width * surface.format.bytes();
@@ -547,18 +548,24 @@ namespace mango
         if (!encode)
             return;
 
-        ConcurrentQueue queue;
+        MANGO_TRACE_SCOPE("image", "TextureCompressionInfo::compress");
 
         u8* address = memory.address;
 
         const int xblocks = round_multiple_up(surface.width, width);
         const int yblocks = round_multiple_up(surface.height, height);
 
-        for (int y = 0; y < yblocks; ++y)
+        ConcurrentQueue queue("texture.compress", Priority::NORMAL);
+
+        parallel_for(queue, 0, yblocks, 1, [this, xblocks, &surface, address] (int y0, int y1)
         {
-            queue.enqueue([this, y, xblocks, &surface, address]
+            ScratchScope scratch;
+
+            const int stride = width * format.bytes();
+            Surface temp(width, height, format, stride, scratch.allocate<u8>(stride * height));
+
+            for (int y = y0; y < y1; ++y)
             {
-                Bitmap temp(width, height, format);
                 u8* data = address + y * xblocks * bytes;
 
                 for (int x = 0; x < xblocks; ++x)
@@ -570,10 +577,8 @@ namespace mango
                     encode(*this, data, image, temp.stride);
                     data += bytes;
                 }
-            });
-        }
-
-        queue.wait();
+            }
+        });
     }
 
 } // namespace mango
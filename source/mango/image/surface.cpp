@@ -6,6 +6,7 @@
 #include <algorithm>
 #include <mango/core/exception.hpp>
 #include <mango/core/thread.hpp>
+#include <mango/core/trace.hpp>
 #include <mango/core/string.hpp>
 #include <mango/core/bits.hpp>
 #include <mango/core/half.hpp>
@@ -300,6 +301,7 @@ namespace mango
         {
             filesystem::FileStream file(filename, Stream::WRITE);
             encoder.encode(file, *this, quality);
+            file.flush();
         }
     }
 
@@ -323,31 +325,15 @@ namespace mango
                 {
                     u32 color = format.pack(red, green, blue, alpha);
 
-#if 1
-                    // super simple multi-threaded buffer clearing
+                    const int grain = std::max(1, 8192 / std::max(width, 1));
 
-                    std::thread top([=] {
-                        for (int y = 0; y < height / 2; ++y)
+                    ConcurrentQueue queue("clear", Priority::HIGH);
+                    parallel_for(queue, 0, height, grain, [=] (int y0, int y1) {
+                        for (int y = y0; y < y1; ++y)
                         {
                             func(image + y * stride, width, color);
                         }
                     });
-
-                    std::thread bottom([=] {
-                        for (int y = height / 2; y < height; ++y)
-                        {
-                            func(image + y * stride, width, color);
-                        }
-                    });
-
-                    top.join();
-                    bottom.join();
-#else
-                    for (int y = 0; y < height; ++y)
-                    {
-                        func(image + y * stride, width, color);
-                    }
-#endif
                 }
 
                 break;
@@ -387,6 +373,8 @@ namespace mango
 
     void Surface::blit(int x, int y, const Surface& source)
     {
+        MANGO_TRACE_SCOPE("image", "Surface::blit");
+
         if (!source.width || !source.height || !source.format.bits || !format.bits)
             return;
 
@@ -404,58 +392,34 @@ namespace mango
         rect.width = dest.width;
         rect.height = dest.height;
 
-        ConcurrentQueue queue("blit", Priority::HIGH);
-
         Blitter blitter(dest.format, source.format);
 
-        const int threads = ThreadPool::getInstanceSize();
-        const int tasksize = (rect.width * rect.height) / threads;
-
         const bool fast = dest.format == source.format;
 
-        // don't use thread pool for:
-        // - really small tasks
-        // - when the pixel formats are identical ("fast mode")
-        const int N = (tasksize < 8192) || fast ? 1 : threads;
-        const int section = rect.height / N;
-
-        int ypos = 0;
-
-        // queue conversion tasks
-        for (int i = 0; i < N; ++i)
+        auto convert = [&] (int y0, int y1)
         {
-            const bool last = (i == (N - 1));
-            const int ycount = last ? rect.height - ypos : section;
-
-            if (N == 1)
-            {
-                // execute on main thread
-                BlitRect temp = rect;
+            BlitRect temp = rect;
 
-                temp.dest.address += ypos * rect.dest.stride;
-                temp.src.address += ypos * rect.src.stride;
-                temp.height = ycount;
+            temp.dest.address += y0 * rect.dest.stride;
+            temp.src.address += y0 * rect.src.stride;
+            temp.height = y1 - y0;
 
-                blitter.convert(temp);
-            }
-            else
-            {
-                queue.enqueue([=, &blitter]
-                {
-                    BlitRect temp = rect;
+            blitter.convert(temp);
+        };
 
-                    temp.dest.address += ypos * rect.dest.stride;
-                    temp.src.address += ypos * rect.src.stride;
-                    temp.height = ycount;
-
-                    blitter.convert(temp);
-                });
-            }
-
-            ypos += section;
+        if (fast)
+        {
+            // don't use thread pool when the pixel formats are identical ("fast mode")
+            convert(0, rect.height);
         }
+        else
+        {
+            // don't split into really small tasks
+            const int grain = std::max(1, 8192 / rect.width);
 
-        queue.wait();
+            ConcurrentQueue queue("blit", Priority::HIGH);
+            parallel_for(queue, 0, rect.height, grain, convert);
+        }
     }
 
     void Surface::xflip()
@@ -525,6 +489,7 @@ namespace mango
 
     Bitmap::Bitmap(int width_, int height_, const Format& format_, int stride_, u8* image_)
         : Surface(width_, height_, format_, stride_, image_)
+        , m_allocation(Allocation::DEFAULT)
     {
         if (!stride)
         {
@@ -537,38 +502,53 @@ namespace mango
         }
     }
 
+    Bitmap::Bitmap(int width_, int height_, const Format& format_, Allocation allocation)
+        : Surface(width_, height_, format_, 0, nullptr)
+        , m_allocation(allocation)
+    {
+        stride = width * format.bytes();
+        image = allocate_storage(size_t(stride) * height, allocation);
+    }
+
     Bitmap::Bitmap(Memory memory, const std::string& extension)
         : Surface(load_surface(memory, extension, nullptr))
+        , m_allocation(Allocation::DEFAULT)
     {
     }
 
     Bitmap::Bitmap(Memory memory, const std::string& extension, const Format& format)
         : Surface(load_surface(memory, extension, &format))
+        , m_allocation(Allocation::DEFAULT)
     {
     }
 
     Bitmap::Bitmap(const std::string& filename)
         : Surface(load_surface(filename, nullptr))
+        , m_allocation(Allocation::DEFAULT)
     {
     }
 
     Bitmap::Bitmap(const std::string& filename, const Format& format)
         : Surface(load_surface(filename, &format))
+        , m_allocation(Allocation::DEFAULT)
     {
     }
 
     Bitmap::Bitmap(Memory memory, const std::string& extension, Palette& palette)
         : Surface(load_palette_surface(memory, extension, palette))
+        , m_allocation(Allocation::DEFAULT)
     {
     }
 
     Bitmap::Bitmap(const std::string& filename, Palette& palette)
         : Surface(load_palette_surface(filename, palette))
+        , m_allocation(Allocation::DEFAULT)
     {
     }
 
     Bitmap::Bitmap(Bitmap&& bitmap)
         : Surface(bitmap)
+        , m_allocation(bitmap.m_allocation)
     {
         // move image ownership
         bitmap.image = nullptr;
@@ -576,11 +556,17 @@ namespace mango
 
     Bitmap::~Bitmap()
     {
-        delete[] image;
+        free_storage(image, m_allocation);
     }
 
     Bitmap& Bitmap::operator = (Bitmap&& bitmap)
     {
+        if (this == &bitmap)
+            return *this;
+
+        // release current image
+        free_storage(image, m_allocation);
+
         // copy surface
         format = bitmap.format;
         image = bitmap.image;
@@ -589,6 +575,7 @@ namespace mango
         height = bitmap.height;
 
         // move image ownership
+        m_allocation = bitmap.m_allocation;
         bitmap.image = nullptr;
 
         return *this;
@@ -6,6 +6,7 @@
 #include <mango/core/endian.hpp>
 #include <mango/core/cpuinfo.hpp>
 #include <mango/core/thread.hpp>
+#include <mango/core/trace.hpp>
 #include "jpeg.hpp"
 
 namespace jpeg
@@ -709,6 +710,8 @@ namespace jpeg
 
     u8* Parser::processSOS(u8* p, u8* end)
     {
+        MANGO_TRACE_SCOPE("jpeg", "processSOS");
+
         jpegPrint("[ SOS ]\n");
 
         u16 length = uload16be(p);
@@ -1311,6 +1314,8 @@ namespace jpeg
 
     Status Parser::decode(Surface& target)
     {
+        MANGO_TRACE_SCOPE("jpeg", "decode");
+
         Status status;
 
         status.success = true;
@@ -1535,6 +1540,8 @@ namespace jpeg
 
     void Parser::decodeSequentialMT()
     {
+        MANGO_TRACE_SCOPE("jpeg", "decodeSequentialMT");
+
         const int stride = m_surface->stride;
         const int xstride = m_surface->format.bytes() * xblock;
         const int ystride = stride * yblock;
@@ -1542,19 +1549,24 @@ namespace jpeg
 
         ConcurrentQueue queue("jpeg.sequential", Priority::HIGH);
 
+        // stop decoding when the task which called the decoder is cancelled
+        const CancellationToken token = CancellationToken::current();
+
         if (!restartInterval)
         {
             BlockType* data = blockVector;
             const int mcu_data_size = blocks_in_mcu * 64;
 
-            const int pool_size = ThreadPool::getInstanceSize();
-
-            const int S = pool_size > 1 ? 4 * pool_size : 1;
-            const int N = std::max(ymcu / S, pool_size);
+            // the entropy decoding is serial; hand the decoded rows to the
+            // threadpool in the same sized pieces as parallel_for() would
+            const int N = parallel_grain(ymcu);
 
             // use threadpool to process blocks
             for (int y = 0; y < ymcu; y += N)
             {
+                if (token.isCancelled())
+                    break;
+
                 const int y0 = y;
                 const int y1 = std::min(y + N, ymcu);
                 const int count = (y1 - y0) * xmcu;
@@ -1570,6 +1582,8 @@ namespace jpeg
 
                 // enqueue task
                 queue.enqueue([=] {
+                    MANGO_TRACE_SCOPE("jpeg", "process rows");
+
                     for (int y = y0; y < y1; ++y)
                     {
                         u8* dest = image + y * ystride;
@@ -1607,8 +1621,16 @@ namespace jpeg
 
             for (int i = 0; i < mcus; i += restartInterval)
             {
+                if (token.isCancelled())
+                    break;
+
                 // enqueue task
                 queue.enqueue([=] {
+                    if (token.isCancelled())
+                        return;
+
+                    MANGO_TRACE_SCOPE("jpeg", "decode interval");
+
                     BlockType data[640]; // TODO: alignment
                     DecodeState state = decodeState;
                     state.buffer.ptr = p;
@@ -1663,6 +1685,11 @@ namespace jpeg
         const bool dc_scan = (decodeState.spectralStart == 0);
         BlockType* data = blockVector;
 
+        // stop decoding when the task which called the decoder is cancelled
+        const CancellationToken token = CancellationToken::current();
+        if (token.isCancelled())
+            return;
+
         if (dc_scan)
         {
             if (decodeState.comps_in_scan == 1 && decodeState.blocks > 1)
@@ -1705,6 +1732,9 @@ namespace jpeg
 
         for (int y = 0; y < ys; ++y)
         {
+            if (token.isCancelled())
+                return;
+
             int mcu_yoffset = (y >> vsf) * xmcu;
             int block_yoffset = ((y & VMask) << hsf) + scan_offset;
 
@@ -1788,53 +1818,47 @@ namespace jpeg
         BlockType* data = blockVector;
 
         ConcurrentQueue queue("jpeg.progressive", Priority::HIGH);
-        const int pool_size = ThreadPool::getInstanceSize();
 
-        const int S = pool_size > 1 ? 4 * pool_size : 1;
-        const int N = std::max(ymcu / S, pool_size);
+        // stop decoding when the task which called the decoder is cancelled
+        const CancellationToken token = CancellationToken::current();
 
         // use threadpool to process blocks
-        for (int y = 0; y < ymcu; y += N)
-        {
-            const int y0 = y;
-            const int y1 = std::min(y + N, ymcu);
+        parallel_for(queue, 0, ymcu, 1, [=] (int y0, int y1) {
+            MANGO_TRACE_SCOPE("jpeg", "process rows");
             jpegPrint("  Process: [%d, %d] --> ThreadPool.\n", y0, y1 - 1);
 
-            // enqueue task
-            queue.enqueue([=] {
-                for (int y = y0; y < y1; ++y)
-                {
-                    u8* dest = image + y * ystride;
-                    BlockType* source = data + y * xmcu * mcu_data_size;
+            for (int y = y0; y < y1; ++y)
+            {
+                if (token.isCancelled())
+                    return;
 
-                    ProcessFunc process = processState.process;
-                    int width = xblock;
-                    int height = yblock;
+                u8* dest = image + y * ystride;
+                BlockType* source = data + y * xmcu * mcu_data_size;
 
-                    if (yclip && y == ymcu - 1)
+                ProcessFunc process = processState.process;
+                int width = xblock;
+                int height = yblock;
+
+                if (yclip && y == ymcu - 1)
+                {
+                    process = processState.clipped;
+                    height = yclip;
+                }
+
+                for (int x = 0; x < xmcu; ++x)
+                {
+                    if (xclip && x == xmcu - 1)
                     {
                         process = processState.clipped;
-                        height = yclip;
+                        width = xclip;
                     }
 
-                    for (int x = 0; x < xmcu; ++x)
-                    {
-                        if (xclip && x == xmcu - 1)
-                        {
-                            process = processState.clipped;
-                            width = xclip;
-                        }
-
-                        process(dest, stride, source, &processState, width, height);
-                        source += mcu_data_size;
-                        dest += xstride;
-                    }
+                    process(dest, stride, source, &processState, width, height);
+                    source += mcu_data_size;
+                    dest += xstride;
                 }
-            });
-        }
-
-        // synchronize
-        queue.wait();
+            }
+        });
     }
 
 } // namespace jpeg
@@ -27,6 +27,7 @@
 //
 
 #include <mango/core/pointer.hpp>
+#include <mango/core/memory.hpp>
 #include "jpeg.hpp"
 #include <cstring>
 
@@ -971,6 +972,66 @@ namespace
         p.write8(0x00);
     }
 
+    // ----------------------------------------------------------------------------
+    // Bitstream
+    // ----------------------------------------------------------------------------
+
+    // huffman bitstream of one MCU scan; the pieces are allocated from an Arena
+    // which is shared by the encoding tasks and released when the image is done
+
+    struct BitstreamPiece
+    {
+        BitstreamPiece* next;
+        size_t size;
+
+        u8* data()
+        {
+            return reinterpret_cast<u8*>(this + 1);
+        }
+    };
+
+    struct Bitstream
+    {
+        BitstreamPiece* head = nullptr;
+        BitstreamPiece* tail = nullptr;
+        size_t count = 0;
+        u8 marker[2];
+
+        void write(Arena& arena, const u8* data, size_t size)
+        {
+            void* memory = arena.allocate(sizeof(BitstreamPiece) + size, alignof(BitstreamPiece));
+            BitstreamPiece* piece = reinterpret_cast<BitstreamPiece*>(memory);
+
+            piece->next = nullptr;
+            piece->size = size;
+            std::memcpy(piece->data(), data, size);
+
+            if (tail)
+                tail->next = piece;
+            else
+                head = piece;
+            tail = piece;
+            ++count;
+        }
+
+        // write the bitstream followed by a restart marker with one gather write
+        void flush(Stream& stream, Arena& arena, int restart)
+        {
+            Memory* segments = arena.allocate<Memory>(count + 1);
+            size_t index = 0;
+
+            for (BitstreamPiece* piece = head; piece; piece = piece->next)
+            {
+                segments[index++] = Memory(piece->data(), piece->size);
+            }
+
+            ustore16be(marker, u16(0xffd0 + restart));
+            segments[index++] = Memory(marker, 2);
+
+            stream.write(segments, index);
+        }
+    };
+
     // ----------------------------------------------------------------------------
     // encodeJPEG()
     // ----------------------------------------------------------------------------
@@ -986,10 +1047,15 @@ namespace
         // writing marker data
         jp.write_markers(s, sample_format, surface.width, surface.height);
 
-        ConcurrentQueue queue;
+        TaskGraph graph("jpeg.encode");
 
         // bitstream for each MCU scan
-        Buffer* buffers = new Buffer[jp.vertical_mcus];
+        Arena arena;
+        std::vector<Bitstream> bitstreams(jp.vertical_mcus);
+        Bitstream* buffers = bitstreams.data();
+
+        // the previous MCU scan written into the stream
+        TaskGraph::Node previous = nullptr;
 
         // encode MCUs
         const int bottom_mcu = jp.vertical_mcus - 1;
@@ -1008,7 +1074,7 @@ namespace
                 rows = jp.rows_in_bottom_mcus;
             }
 
-            queue.enqueue([&jp, y, buffers, input, rows] {
+            TaskGraph::Node encode = graph.enqueue([&jp, &arena, y, buffers, input, rows] {
                 u8* image = input;
 
                 HuffmanEncoder huffman;
@@ -1054,7 +1120,7 @@ namespace
                     // flush encoding buffer
                     if (ptr - huff_temp > flush_threshold)
                     {
-                        buffers[y].write(huff_temp, ptr - huff_temp);
+                        buffers[y].write(arena, huff_temp, ptr - huff_temp);
                         ptr = huff_temp;
                     }
 
@@ -1063,27 +1129,20 @@ namespace
 
                 // flush encoding buffer
                 ptr = huffman.flush(ptr);
-                buffers[y].write(huff_temp, ptr - huff_temp);
+                buffers[y].write(arena, huff_temp, ptr - huff_temp);
             });
 
-            input += surface.stride * jp.mcu_height;
-        }
-
-        queue.wait();
-
-        for (int y = 0; y < jp.vertical_mcus; ++y)
-        {
-            Buffer& buffer = buffers[y];
-
-            // write huffman bitstream
-            s.write(buffer, size_t(buffer.size()));
+            // write the MCU scan as soon as it and the scans above it are in the stream;
+            // a failed write cancels the rest and is rethrown by graph.wait() on this thread
+            previous = graph.enqueueAfter({ encode, previous }, [&stream, &arena, y, buffers] {
+                // write huffman bitstream and restart marker
+                buffers[y].flush(stream, arena, y & 7);
+            });
 
-            // write restart marker
-            int index = y & 7;
-            s.write16(0xffd0 + index);
+            input += surface.stride * jp.mcu_height;
         }
 
-        delete[] buffers;
+        graph.wait();
 
         // EOI marker
         s.write16(0xffd9);